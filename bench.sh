@@ -0,0 +1,129 @@
+#!/bin/bash
+#
+# Cost of each power/ina219 operation against the simulated board (see
+# powersim.c): wall time, syscalls, I2C transactions and time on the wire
+# at the simulated bus clock, averaged over BENCH_RUNS runs (default 20).
+# Each tool path is then recorded against the simulator and replayed from
+# the recording (see powerreplay.c), which must give the same output.
+#
+
+. "$(dirname "$0")/simtest.sh"
+
+RUNS=${BENCH_RUNS:-20}
+STATS=$(mktemp)
+IMAGE=$(mktemp)
+FLASH=$(mktemp)
+RECORDING=$(mktemp)
+OUTPUT=$(mktemp)
+STATE=$(mktemp -d)
+FAILED=0
+
+export PU_TRANSPORT=sim
+export PU_SIM_STATS=$STATS
+export PU_STATE_DIR=$STATE      # keep manifests and checkpoints off the real ones
+
+trap 'rm -f $STATS $IMAGE $FLASH $FLASH.* $RECORDING $OUTPUT $OUTPUT.*; rm -rf $STATE' EXIT
+
+# report <name> <runs> <wall ns>, sums the per-process lines in $STATS
+report()
+{
+    awk -v name="$1" -v runs=$2 -v ns=$3 '
+        { sys += $1; trans += $2; bus += $5 }
+        END {
+            wall = ( ns > 0 ) ? sprintf( "%10.2f", ns / runs / 1e6 ) : sprintf( "%10s", "-" )
+            printf( "%-24s %5d %s %9.1f %9.1f %9.3f\n", name, runs, wall, sys / runs, trans / runs, bus / runs / 1000 )
+        }' $STATS
+}
+
+# bench <name> <runs> <command...>
+bench()
+{
+    local name=$1 runs=$2 start i
+
+    shift 2
+    : > $STATS
+    start=$(now)
+    for (( i = 0; i < runs; i++ )); do
+        if ! "$@" > /dev/null 2>&1; then
+            echo "$name: failed"
+            FAILED=1
+            return
+        fi
+    done
+    report "$name" $runs $(( $(now) - start ))
+}
+
+# Monitor mode runs until interrupted, costs are per sample taken
+bench_monitor()
+{
+    local name=$1 samples
+
+    shift
+    : > $STATS
+    samples=$(timeout -s INT 2 "$@" 2> /dev/null | grep -c mV)
+    if [ "$samples" -eq 0 ]; then
+        echo "$name: failed"
+        FAILED=1
+        return
+    fi
+    report "$name" $samples 0
+}
+
+# Output with the timings, which a fast replay doesn't reproduce, masked
+untimed()
+{
+    tr '\r' '\n' | sed -E 's/ *[0-9.-]+ (us|s|bytes\/s)\b/ _/g'
+}
+
+# replay <name> <command...>, records a run and replays it as fast as
+# possible; a call that doesn't match the recording fails with EPROTO
+replay()
+{
+    local name=$1
+
+    shift
+    if ! PU_RECORD=$RECORDING "$@" > $OUTPUT.recorded 2>&1; then
+        echo "$name: failed while recording"
+        FAILED=1
+    elif ! PU_TRANSPORT=replay PU_REPLAY=$RECORDING PU_REPLAY_SPEED=fast "$@" > $OUTPUT.replayed 2>&1; then
+        echo "$name: replay failed: $(grep -m 1 -i error $OUTPUT.replayed)"
+        FAILED=1
+    elif ! cmp -s <(untimed < $OUTPUT.recorded) <(untimed < $OUTPUT.replayed); then
+        echo "$name: replay output differs from the recording"
+        FAILED=1
+    else
+        printf "%-24s replay matches recording\n" "$name"
+    fi
+}
+
+# The simulated board's flash after an upload must hold the image
+check_flash()
+{
+    if ! cmp -s -n $(stat -c %s $IMAGE) $IMAGE $FLASH.*-60; then
+        echo "$1: flash does not match the image"
+        FAILED=1
+    fi
+}
+
+mkimage $IMAGE
+
+printf "%-24s %5s %10s %9s %9s %9s\n" "operation" "runs" "wall ms" "syscalls" "transact" "bus ms"
+
+bench "power -q" $RUNS ./power -q
+for v in button pgood rate ontime offtime restart; do
+    bench "power -v $v" $RUNS ./power -v $v
+done
+bench "power -r" $RUNS ./power -r
+bench "power -w" 3 ./power -w                      # waits for the next second
+PU_SIM_BOOT=1 PU_SIM_FLASH=$FLASH bench "power -Z (6000 bytes)" 3 ./power -F -Z $IMAGE
+check_flash "power -Z"
+bench "ina219 one-shot" $RUNS ./ina219
+bench_monitor "ina219 monitor (sample)" ./ina219 -i 100ms
+
+echo
+replay "power -q" ./power -q
+replay "power -v rate -r" ./power -v rate -r
+PU_SIM_BOOT=1 replay "power -Z (6000 bytes)" ./power -F -Z $IMAGE
+replay "ina219 one-shot" ./ina219
+
+exit $FAILED
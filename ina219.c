@@ -1,16 +1,18 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
 #include <endian.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/ioctl.h>
 #include <fcntl.h>
-#include <linux/i2c-dev.h>
+#include "powerutils.h"
 
 #define CONFIG_REG          0
 #define SHUNT_REG           1
@@ -20,96 +22,502 @@
 #define CALIBRATION_REG     5
 
 #define INA_ADDRESS         0x40
+#define SHUNT_OHMS          0.01    // Power HAT battery shunt
+#define MAX_SENSORS         16
+
+#define CONFIG_DEFAULT      0x25DF  // 32V, gain x1, 12-bit 8 sample avg, continuous
+
+#define CONFIG_BRNG         0x2000  // Bus range 32V (16V when clear)
+#define CONFIG_PG_SHIFT     11      // PGA gain: shunt range 40mV << PG
+#define CONFIG_PG_MASK      0x1800
+#define CONFIG_BADC_SHIFT   7
+#define CONFIG_SADC_SHIFT   3
+#define CONFIG_ADC_MASK     0x07F8  // BADC and SADC
+#define CONFIG_MODE_MASK    0x0007
+
+#define ADC_12BIT           0x3     // BADC/SADC: 9-12 bit = 0x0-0x3, 2^n samples = 0x8|n
+#define MODE_TRIGGERED      0x3     // Shunt and bus, triggered
+#define MODE_CONTINUOUS     0x7     // Shunt and bus, continuous
+
+#define SHUNT_FULL_SCALE    4000    // Shunt register counts at 40mV, doubles per PG step
+#define AUTOGAIN_UP_PCT     95      // Switch to the widest range at this much of full scale
+#define AUTOGAIN_DOWN_PCT   40      // Narrow the range below this much of the next range...
+#define AUTOGAIN_HOLD       4       // ...for this many consecutive conversions
+
+#define BUS_CNVR            0x0002  // Conversion ready
+#define BUS_OVF             0x0001  // Math overflow
+
+#define BURST_MAX_SAMPLES   ( 1024 * 1024 )
+
+#define CAPTURE_MAGIC       "INAC"
+#define CAPTURE_VERSION     1
+#define CAPTURE_BUFFER_SIZE ( 256 * 1024 )
+
+// Capture record flags
+#define CAP_FLAG_OVF        0x0001  // Bus register OVF bit was set
+#define CAP_FLAG_MISSED     0x0002  // One or more deadlines missed before this sample
+#define CAP_FLAG_PG_SHIFT   8       // Bits 8-9: PGA setting that produced the sample
+#define CAP_FLAG_PG_MASK    0x0300
 
 typedef enum {
     OP_DUMP,
     OP_VOLTAGE,
     OP_CURRENT,
+    OP_POWER,
     OP_MONITOR,
+    OP_BURST,
+    OP_EXPORT,
     OP_NONE
 } op_type;
 
 op_type operation = OP_DUMP;
 
-int interval = 60;
+uint64_t interval_ns = 60000000000ULL;
+volatile sig_atomic_t running = 1;
 #ifdef BEAGLEBONE
  int i2c_bus = 2;
 #else
  int i2c_bus = 1;
 #endif
 int i2c_address = INA_ADDRESS;
-int handle;
 int whole_numbers = 0;
+int burst_count = 0;
+uint64_t burst_ns = 0;
+unsigned short ina_config = CONFIG_DEFAULT;
+int adc_setting = -1;               // -1 leaves the default averaging
+int autogain = 0;
+double shunt_ohms = SHUNT_OHMS;
+uint64_t energy_report_ns = 600000000000ULL;
+int show_timing = 0;
+
+typedef struct
+{
+    uint64_t        ns;         // CLOCK_MONOTONIC
+    unsigned short  bus;        // Raw bus voltage register
+    short           shunt;      // Raw shunt voltage register
+    unsigned char   pg;         // PGA setting used
+} sample_t;
+
+// Binary capture file layout, all fields little endian
+typedef struct __attribute__(( packed ))
+{
+    char            magic[ 4 ];     // CAPTURE_MAGIC
+    uint16_t        version;
+    uint16_t        record_size;    // sizeof( capture_record_t )
+    uint16_t        config;         // CONFIG_REG value used for the capture
+    uint8_t         bus;            // I2C bus number
+    uint8_t         address;        // INA219 address
+    uint64_t        interval_ns;    // Requested interval, 0 for burst captures
+    uint64_t        mono_base_ns;   // CLOCK_MONOTONIC at start...
+    uint64_t        real_base_ns;   // ...and CLOCK_REALTIME at the same instant
+    uint32_t        shunt_uohm;     // Shunt resistor
+    uint16_t        sensors;        // capture_sensor_t entries that follow
+    uint16_t        reserved;
+} capture_header_t;
+
+typedef struct __attribute__(( packed ))
+{
+    uint8_t         bus;
+    uint8_t         address;
+    uint16_t        config;
+    uint32_t        shunt_uohm;
+} capture_sensor_t;
+
+typedef struct __attribute__(( packed ))
+{
+    uint64_t        ns;             // CLOCK_MONOTONIC
+    uint16_t        bus;            // Raw bus voltage register
+    int16_t         shunt;          // Raw shunt voltage register
+    uint16_t        flags;          // CAP_FLAG_*
+    uint16_t        sensor;         // Index into the sensor table
+} capture_record_t;
+
+// Running coulomb/energy totals, trapezoidal over sample timestamps
+typedef struct
+{
+    int             valid;
+    uint64_t        start_ns;
+    uint64_t        last_ns;
+    float           last_ma;
+    float           last_mw;
+    double          mah;
+    double          mwh;
+} energy_t;
+
+// Per-sensor state, one per bus:address being sampled
+typedef struct
+{
+    int             bus;            // I2C bus number
+    int             address;        // I2C address
+    pu_dev_t        dev;            // bus handle, shared with sensors on the same bus
+    double          shunt_ohms;
+    unsigned short  config;         // CONFIG_REG value in use
+    unsigned short  calibration;
+    double          current_lsb;    // mA per CURRENT_REG count, power is 20x
+    int             conversion_us;  // Time for one full conversion in config
+    int             autogain_low;   // Consecutive conversions fitting a narrower range
+    int             sample_pg;      // PGA setting behind the last conversion read
+
+    // Latest monitor sample
+    int             valid;
+    uint64_t        ns;
+    unsigned short  raw_bus;
+    short           raw_shunt;
+    float           mv, ma, mw;
+    energy_t        energy;
+} ina_t;
+
+ina_t sensors[ MAX_SENSORS ];
+int   sensor_count = 0;
+
+// One sampling thread per I2C bus
+typedef struct
+{
+    int             bus;
+    ina_t          *sensors[ MAX_SENSORS ];
+    int             count;
+    pthread_t       thread;
+    uint64_t        wakeups;
+    uint64_t        late_min;
+    uint64_t        late_max;
+    double          late_sum;
+} bus_worker_t;
+
+pthread_barrier_t tick_barrier;
+pthread_mutex_t tick_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tick_wake;           // CLOCK_MONOTONIC, broadcast at shutdown
+uint64_t tick_deadline;             // Next sample tick, shared by all workers
+uint64_t tick_missed;
+uint16_t tick_flags;
+uint64_t tick_report;
+int      tick_stop;
+
+char *capture_name = NULL;
+int  capture_fd = -1;
+unsigned char *capture_buf;
+int  capture_len = 0;
 
 
 void msleep( int msecs )
 {
-    usleep( msecs * 1000 );
+    pu_sleep_us( msecs * 1000 );
 }
 
 
-int i2c_read( void *buf, int len )
+uint64_t monotonic_ns( void )
 {
-    int rc = 0;
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( (uint64_t)ts.tv_sec * 1000000000ULL ) + ts.tv_nsec;
+}
+
 
-    if ( read( handle, buf, len ) != len )
+// Bus access goes through libpowerutils, failures are reported here
+int ina_error( ina_t *ina, int rc )
+{
+    if ( rc == PU_ERR_IO )
     {
-        printf( "I2C read failed: %s\n", strerror( errno ) );
-        rc = -1;
+        printf( "I2C transfer failed: %s\n", strerror( ina->dev.errnum ) );
     }
 
-    return rc;
+    return ( rc == PU_OK ) ? 0 : -1;
 }
 
 
-int i2c_write( void *buf, int len )
+int register_read( ina_t *ina, unsigned char reg, unsigned short *data )
 {
-    int rc = 0;
-    
-    if ( write( handle, buf, len ) != len ) 
+    return ina_error( ina, pu_reg16_read( &ina->dev, reg, data ) );
+}
+
+
+int register_read_multi( ina_t *ina, const unsigned char *regs, unsigned short *data, int count )
+{
+    return ina_error( ina, pu_reg16_read_multi( &ina->dev, regs, data, count ) );
+}
+
+
+int register_write( ina_t *ina, unsigned char reg, unsigned short data )
+{
+    return ina_error( ina, pu_reg16_write( &ina->dev, reg, data ) );
+}
+
+
+int capture_flush( void )
+{
+    int n, off = 0;
+
+    while ( off < capture_len )
     {
-        printf( "I2C write failed: %s\n", strerror( errno ) );
-        rc = -1;
+        n = write( capture_fd, capture_buf + off, capture_len - off );
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            fprintf( stderr, "Error writing %s: %s\n", capture_name, strerror( errno ) );
+            return -1;
+        }
+        off += n;
     }
-    
-    return rc;
+    capture_len = 0;
+
+    return 0;
 }
 
 
-int register_read( unsigned char reg, unsigned short *data )
+// Sensors 0..count-1 are described in the header's sensor table, the
+// legacy single-sensor fields hold sensor 0
+int capture_open( uint16_t config, uint64_t interval, int count )
 {
-    int rc = -1;
-    unsigned char bite[ 4 ];
-    
-    bite[ 0 ] = reg;
-    if ( i2c_write( bite, 1 ) == 0 )
+    capture_header_t hdr;
+    capture_sensor_t entry;
+    struct timespec ts;
+    int i;
+
+    capture_fd = open( capture_name, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( capture_fd < 0 )
+    {
+        fprintf( stderr, "Error opening %s: %s\n", capture_name, strerror( errno ) );
+        return -1;
+    }
+
+    capture_buf = malloc( CAPTURE_BUFFER_SIZE );
+    if ( capture_buf == NULL )
+    {
+        fprintf( stderr, "Error allocating capture buffer\n" );
+        close( capture_fd );
+        capture_fd = -1;
+        return -1;
+    }
+
+    memset( &hdr, 0, sizeof( hdr ) );
+    memcpy( hdr.magic, CAPTURE_MAGIC, 4 );
+    hdr.version = htole16( CAPTURE_VERSION );
+    hdr.record_size = htole16( sizeof( capture_record_t ) );
+    hdr.config = htole16( config );
+    hdr.bus = sensors[ 0 ].bus;
+    hdr.address = sensors[ 0 ].address;
+    hdr.interval_ns = htole64( interval );
+    hdr.mono_base_ns = htole64( monotonic_ns() );
+    clock_gettime( CLOCK_REALTIME, &ts );
+    hdr.real_base_ns = htole64( ( (uint64_t)ts.tv_sec * 1000000000ULL ) + ts.tv_nsec );
+    hdr.shunt_uohm = htole32( (uint32_t)( sensors[ 0 ].shunt_ohms * 1e6 + 0.5 ) );
+    hdr.sensors = htole16( count );
+
+    memcpy( capture_buf, &hdr, sizeof( hdr ) );
+    capture_len = sizeof( hdr );
+
+    for ( i = 0; i < count; i++ )
+    {
+        entry.bus = sensors[ i ].bus;
+        entry.address = sensors[ i ].address;
+        entry.config = htole16( ( i == 0 ) ? config : sensors[ i ].config );
+        entry.shunt_uohm = htole32( (uint32_t)( sensors[ i ].shunt_ohms * 1e6 + 0.5 ) );
+        memcpy( capture_buf + capture_len, &entry, sizeof( entry ) );
+        capture_len += sizeof( entry );
+    }
+
+    return 0;
+}
+
+
+int capture_write( uint64_t ns, int sensor, unsigned short bus, short shunt, uint16_t flags )
+{
+    capture_record_t rec;
+
+    if ( capture_len + sizeof( rec ) > CAPTURE_BUFFER_SIZE )
+    {
+        if ( capture_flush() != 0 )
+            return -1;
+    }
+
+    rec.ns = htole64( ns );
+    rec.bus = htole16( bus );
+    rec.shunt = (int16_t)htole16( (uint16_t)shunt );
+    rec.flags = htole16( flags | ( ( bus & BUS_OVF ) ? CAP_FLAG_OVF : 0 ) );
+    rec.sensor = htole16( sensor );
+
+    memcpy( capture_buf + capture_len, &rec, sizeof( rec ) );
+    capture_len += sizeof( rec );
+
+    return 0;
+}
+
+
+void capture_close( void )
+{
+    if ( capture_fd < 0 )
+        return;
+
+    capture_flush();
+    close( capture_fd );
+    free( capture_buf );
+    capture_fd = -1;
+}
+
+
+// Convert a binary capture to CSV on stdout
+int capture_export( void )
+{
+    capture_header_t hdr;
+    capture_record_t rec;
+    capture_sensor_t table[ MAX_SENSORS ];
+    uint64_t mono, real, t;
+    unsigned short bus;
+    size_t count;
+    FILE *fp;
+    int i, rc = 0;
+
+    fp = fopen( capture_name, "rb" );
+    if ( fp == NULL )
     {
-        if ( i2c_read( bite, 2 ) == 0 )
+        fprintf( stderr, "Error opening %s: %s\n", capture_name, strerror( errno ) );
+        return 1;
+    }
+
+    if ( ( fread( &hdr, sizeof( hdr ), 1, fp ) != 1 ) ||
+         ( memcmp( hdr.magic, CAPTURE_MAGIC, 4 ) != 0 ) ||
+         ( le16toh( hdr.version ) != CAPTURE_VERSION ) ||
+         ( le16toh( hdr.record_size ) != sizeof( rec ) ) )
+    {
+        fprintf( stderr, "%s is not a supported capture file\n", capture_name );
+        fclose( fp );
+        return 1;
+    }
+
+    count = le16toh( hdr.sensors );
+    if ( ( count < 1 ) || ( count > MAX_SENSORS ) ||
+         ( fread( table, sizeof( table[ 0 ] ), count, fp ) != count ) )
+    {
+        fprintf( stderr, "%s has a bad sensor table\n", capture_name );
+        fclose( fp );
+        return 1;
+    }
+
+    mono = le64toh( hdr.mono_base_ns );
+    real = le64toh( hdr.real_base_ns );
+
+    printf( "# interval_ns %llu\n", (unsigned long long)le64toh( hdr.interval_ns ) );
+    for ( i = 0; i < (int)count; i++ )
+    {
+        printf( "# sensor %d:0x%02X config 0x%04X shunt %g\n",
+                table[ i ].bus, table[ i ].address, le16toh( table[ i ].config ),
+                le32toh( table[ i ].shunt_uohm ) / 1e6 );
+    }
+    printf( "time,sensor,mV,mA,gain,flags\n" );
+
+    while ( fread( &rec, sizeof( rec ), 1, fp ) == 1 )
+    {
+        i = le16toh( rec.sensor );
+        if ( i >= (int)count )
         {
-            *data = ( bite[ 0 ] << 8 ) | bite[ 1 ];
-            rc = 0;
+            fprintf( stderr, "Record for unknown sensor %d\n", i );
+            rc = 1;
+            break;
         }
+
+        t = real + ( le64toh( rec.ns ) - mono );
+        bus = le16toh( rec.bus );
+        printf( "%llu.%06llu,%d:0x%02X,%d,%.1f,%d,%d\n",
+                (unsigned long long)( t / 1000000000ULL ),
+                (unsigned long long)( ( t % 1000000000ULL ) / 1000 ),
+                table[ i ].bus, table[ i ].address,
+                ( bus & 0xFFF8 ) >> 1,
+                (int16_t)le16toh( (uint16_t)rec.shunt ) * 0.01e6 / le32toh( table[ i ].shunt_uohm ),
+                1 << ( ( le16toh( rec.flags ) & CAP_FLAG_PG_MASK ) >> CAP_FLAG_PG_SHIFT ),
+                le16toh( rec.flags ) & ~CAP_FLAG_PG_MASK );
     }
-    
+
+    if ( ferror( fp ) )
+    {
+        fprintf( stderr, "Error reading %s\n", capture_name );
+        rc = 1;
+    }
+
+    fclose( fp );
     return rc;
 }
 
 
-int register_write( unsigned char reg, unsigned short data )
+// Parse "<number>[s|ms|us]", bare numbers are taken in units of unit_ns
+int parse_duration( const char *arg, uint64_t unit_ns, uint64_t *ns )
 {
-    int rc = -1;
-    unsigned char bite[ 4 ];
-    
-    bite[ 0 ] = reg;
-    bite[ 1 ] = ( data >> 8 ) & 0xFF;
-    bite[ 2 ] = ( data & 0xFF );
+    char *end;
+    double d;
 
-    if ( i2c_write( bite, 3 ) == 0 )
+    errno = 0;
+    d = strtod( arg, &end );
+    if ( ( errno != 0 ) || ( end == arg ) || ( d <= 0 ) )
     {
-        rc = 0;
+        return -1;
     }
-    
-    return rc;
+
+    if ( *end == '\0' )
+    {
+        *ns = (uint64_t)( d * unit_ns );
+    }
+    else if ( strcmp( end, "s" ) == 0 )
+    {
+        *ns = (uint64_t)( d * 1e9 );
+    }
+    else if ( strcmp( end, "ms" ) == 0 )
+    {
+        *ns = (uint64_t)( d * 1e6 );
+    }
+    else if ( strcmp( end, "us" ) == 0 )
+    {
+        *ns = (uint64_t)( d * 1e3 );
+    }
+    else
+    {
+        return -1;
+    }
+
+    return ( *ns > 0 ) ? 0 : -1;
+}
+
+
+// Parse "bus:addr[:ohms],..." into the sensor table
+int parse_sensors( char *arg )
+{
+    char *item, *save = NULL, *end;
+    ina_t *ina;
+
+    for ( item = strtok_r( arg, ",", &save ); item != NULL; item = strtok_r( NULL, ",", &save ) )
+    {
+        if ( sensor_count >= MAX_SENSORS )
+        {
+            fprintf( stderr, "At most %d sensors are supported.\n", MAX_SENSORS );
+            return -1;
+        }
+
+        ina = &sensors[ sensor_count ];
+        memset( ina, 0, sizeof( *ina ) );
+        ina->shunt_ohms = shunt_ohms;
+
+        ina->bus = (int)strtol( item, &end, 0 );
+        if ( ( end == item ) || ( *end != ':' ) )
+            return -1;
+
+        item = end + 1;
+        ina->address = (int)strtol( item, &end, 0 );
+        if ( ( end == item ) || ( ina->address < 0x03 ) || ( ina->address > 0x77 ) )
+            return -1;
+
+        if ( *end == ':' )
+        {
+            item = end + 1;
+            ina->shunt_ohms = strtod( item, &end );
+            if ( ( end == item ) || ( ina->shunt_ohms <= 0 ) )
+                return -1;
+        }
+        if ( *end != '\0' )
+            return -1;
+
+        sensor_count++;
+    }
+
+    return 0;
 }
 
 
@@ -118,12 +526,26 @@ void show_usage( char *progname )
     fprintf( stderr, "Usage: %s <mode> \n", progname );
     fprintf( stderr, "   Mode (required):\n" );
     fprintf( stderr, "      -h --help           Show usage.\n" );
-    fprintf( stderr, "      -i --interval       Set interval for monitor mode.\n" );
+    fprintf( stderr, "      -i --interval <t>   Set interval for monitor mode (seconds, or 250ms...).\n" );
+    fprintf( stderr, "      -B --burst <N|time> Capture N samples (or for 500ms, 2s...) at full ADC rate.\n" );
     fprintf( stderr, "      -w --whole          Show whole numbers only. Useful for scripts.\n" );
     fprintf( stderr, "      -v --voltage        Show battery voltage in mV.\n" );
     fprintf( stderr, "      -c --current        Show battery current in mA.\n" );
+    fprintf( stderr, "      -p --power          Show battery power in mW.\n" );
+    fprintf( stderr, "      -s --shunt <ohms>   Shunt resistor value used for calibration (default %g).\n", SHUNT_OHMS );
+    fprintf( stderr, "      -r --resolution <n> ADC resolution, 9-12 bits, no averaging.\n" );
+    fprintf( stderr, "      -n --samples <n>    ADC averaging, 1-128 samples at 12 bits (default 8).\n" );
+    fprintf( stderr, "      -R --range <16|32>  Bus voltage range (default 32V).\n" );
+    fprintf( stderr, "      -g --gain <1-8|auto> Shunt PGA divider, range 40mV x 1, 2, 4 or 8 (default 1).\n" );
+    fprintf( stderr, "      -t --triggered      Convert on demand, the INA219 idles between reads.\n" );
+    fprintf( stderr, "      -E --energy <t>     Energy report period in monitor mode (default 600s).\n" );
     fprintf( stderr, "      -a --address <addr> Override I2C address of INA219 from default of 0x%02X.\n", i2c_address );
     fprintf( stderr, "      -b --bus <i2c bus>  Override I2C bus from default of %d.\n", i2c_bus );
+    fprintf( stderr, "      -S --sensors <list> Sample several INA219s, list of bus:addr[:shunt],...\n" );
+    fprintf( stderr, "      -l --legacy         Use separate write/read transfers instead of I2C_RDWR.\n" );
+    fprintf( stderr, "      -o --output <file>  Write monitor/burst samples to a binary capture file.\n" );
+    fprintf( stderr, "      -x --export <file>  Convert a binary capture file to CSV on stdout.\n" );
+    fprintf( stderr, "      -T --timing         Report latency and I2C transfer count on stderr.\n" );
     exit( 1 );
 }
 
@@ -136,16 +558,30 @@ void parse( int argc, char *argv[] )
         {
             { "address",    0, 0, 'a' },
             { "bus",        0, 0, 'b' },
+            { "burst",      1, 0, 'B' },
             { "current",    0, 0, 'c' },
+            { "energy",     1, 0, 'E' },
             { "help",       0, 0, 'h' },
-            { "interval",   0, 0, 'i' },
+            { "interval",   1, 0, 'i' },
+            { "legacy",     0, 0, 'l' },
+            { "output",     1, 0, 'o' },
+            { "power",      0, 0, 'p' },
+            { "shunt",      1, 0, 's' },
+            { "sensors",    1, 0, 'S' },
+            { "export",     1, 0, 'x' },
+            { "gain",       1, 0, 'g' },
+            { "samples",    1, 0, 'n' },
+            { "resolution", 1, 0, 'r' },
+            { "range",      1, 0, 'R' },
+            { "triggered",  0, 0, 't' },
+            { "timing",     0, 0, 'T' },
             { "voltage",    0, 0, 'v' },
             { "whole",      0, 0, 'w' },
             { NULL,         0, 0, 0 },
         };
         int c;
 
-        c = getopt_long( argc, argv, "a:b:chi:vw", lopts, NULL );
+        c = getopt_long( argc, argv, "a:b:B:cE:g:hi:ln:o:pr:R:s:S:tTvwx:", lopts, NULL );
 
         if( c == -1 )
             break;
@@ -176,12 +612,67 @@ void parse( int argc, char *argv[] )
                 break;
             }
 
+            case 'B':
+            {
+                char *end;
+                long n;
+
+                errno = 0;
+                n = strtol( optarg, &end, 0 );
+                if ( ( errno == 0 ) && ( end != optarg ) && ( *end == '\0' ) )
+                {
+                    burst_count = (int)n;
+                }
+                else if ( parse_duration( optarg, 1000000000ULL, &burst_ns ) != 0 )
+                {
+                    fprintf( stderr, "Invalid burst parameter %s.\n", optarg );
+                    exit( 1 );
+                }
+
+                if ( !burst_ns && ( ( burst_count <= 0 ) || ( burst_count > BURST_MAX_SAMPLES ) ) )
+                {
+                    fprintf( stderr, "Burst limited to %d samples.\n", BURST_MAX_SAMPLES );
+                    exit( 1 );
+                }
+                operation = OP_BURST;
+                break;
+            }
+
             case 'c':
             {
                 operation = OP_CURRENT;
                 break;
             }
 
+            case 'E':
+            {
+                if ( parse_duration( optarg, 1000000000ULL, &energy_report_ns ) != 0 )
+                {
+                    fprintf( stderr, "Invalid energy report period\n" );
+                    exit( 1 );
+                }
+                break;
+            }
+
+            case 'g':
+            {
+                int i = atoi( optarg );
+
+                if ( strcasecmp( optarg, "auto" ) == 0 )
+                {
+                    autogain = 1;
+                    break;
+                }
+                if ( ( i != 1 ) && ( i != 2 ) && ( i != 4 ) && ( i != 8 ) )
+                {
+                    fprintf( stderr, "Invalid gain %s, use 1, 2, 4 or 8.\n", optarg );
+                    exit( 1 );
+                }
+                ina_config &= ~CONFIG_PG_MASK;
+                ina_config |= ( ( i == 1 ) ? 0 : ( i == 2 ) ? 1 : ( i == 4 ) ? 2 : 3 ) << CONFIG_PG_SHIFT;
+                break;
+            }
+
             default:
             case 'h':
             {
@@ -193,8 +684,7 @@ void parse( int argc, char *argv[] )
             case 'i':
             {
                 operation = OP_MONITOR;
-                interval = atoi( optarg );
-                if ( ( interval == 0 ) && ( errno != 0 ) )
+                if ( parse_duration( optarg, 1000000000ULL, &interval_ns ) != 0 )
                 {
                     fprintf( stderr, "Invalid interval value\n" );
                     exit( 1 );
@@ -202,6 +692,112 @@ void parse( int argc, char *argv[] )
                 break;
             }
 
+            case 'l':
+            {
+                pu_set_legacy( 1 );
+                break;
+            }
+
+            case 'n':
+            {
+                int i = atoi( optarg );
+                int n;
+
+                for ( n = 0; n <= 7; n++ )
+                {
+                    if ( i == ( 1 << n ) )
+                        break;
+                }
+                if ( n > 7 )
+                {
+                    fprintf( stderr, "Invalid sample count %s, use a power of 2 up to 128.\n", optarg );
+                    exit( 1 );
+                }
+                adc_setting = 0x8 | n;
+                break;
+            }
+
+            case 'o':
+            {
+                capture_name = optarg;
+                break;
+            }
+
+            case 'p':
+            {
+                operation = OP_POWER;
+                break;
+            }
+
+            case 'r':
+            {
+                int i = atoi( optarg );
+
+                if ( ( i < 9 ) || ( i > 12 ) )
+                {
+                    fprintf( stderr, "Invalid resolution %s, use 9-12.\n", optarg );
+                    exit( 1 );
+                }
+                adc_setting = i - 9;
+                break;
+            }
+
+            case 'R':
+            {
+                int i = atoi( optarg );
+
+                if ( i == 16 )
+                {
+                    ina_config &= ~CONFIG_BRNG;
+                }
+                else if ( i == 32 )
+                {
+                    ina_config |= CONFIG_BRNG;
+                }
+                else
+                {
+                    fprintf( stderr, "Invalid bus range %s, use 16 or 32.\n", optarg );
+                    exit( 1 );
+                }
+                break;
+            }
+
+            case 's':
+            {
+                char *end;
+
+                errno = 0;
+                shunt_ohms = strtod( optarg, &end );
+                if ( ( errno != 0 ) || ( end == optarg ) || ( shunt_ohms <= 0 ) )
+                {
+                    fprintf( stderr, "Invalid shunt value %s.\n", optarg );
+                    exit( 1 );
+                }
+                break;
+            }
+
+            case 'S':
+            {
+                if ( parse_sensors( optarg ) != 0 )
+                {
+                    fprintf( stderr, "Invalid sensor list, use bus:addr[:shunt],...\n" );
+                    exit( 1 );
+                }
+                break;
+            }
+
+            case 't':
+            {
+                ina_config = ( ina_config & ~CONFIG_MODE_MASK ) | MODE_TRIGGERED;
+                break;
+            }
+
+            case 'T':
+            {
+                show_timing = 1;
+                break;
+            }
+
             case 'v':
             {
                 operation = OP_VOLTAGE;
@@ -213,56 +809,340 @@ void parse( int argc, char *argv[] )
                 whole_numbers = 1;
                 break;
             }
+
+            case 'x':
+            {
+                capture_name = optarg;
+                operation = OP_EXPORT;
+                break;
+            }
         }
     }
 }
 
 
-int get_voltage( float *mv )
+// Conversion time in microseconds for a BADC/SADC field value
+int adc_time_us( int adc )
 {
-    short bus;
-
-    do {
-        if ( register_read( BUS_REG, (unsigned short*)&bus ) != 0 )
-        {
-            return -1;
-        }
-        msleep( 10 );
-    } while ( ( bus & 0x2 ) == 0 );
+    static const int us[ 16 ] = {
+        84, 148, 276, 532, 84, 148, 276, 532,
+        532, 1060, 2130, 4260, 8510, 17020, 34050, 68100
+    };
 
-    *mv = ( float )( ( bus & 0xFFF8 ) >> 1 );
-    return 0;
+    return us[ adc & 0xF ];
 }
 
 
-int get_current( float *ma )
+// Time for one shunt and/or bus conversion cycle with the given config
+int config_time_us( unsigned short config )
 {
-    short shunt;
+    int us = 0;
 
-    if ( register_read( SHUNT_REG, &shunt ) != 0 )
-    {
-        return -1;
-    }
+    if ( config & 0x1 ) us += adc_time_us( config >> CONFIG_SADC_SHIFT );
+    if ( config & 0x2 ) us += adc_time_us( config >> CONFIG_BADC_SHIFT );
 
-    *ma = (float)shunt;
-    return 0;
+    return us;
 }
 
 
-void show_current( void )
+unsigned short config_with_adc( unsigned short config, int adc )
 {
-    float ma;
+    config &= ~CONFIG_ADC_MASK;
+    config |= ( adc << CONFIG_BADC_SHIFT ) | ( adc << CONFIG_SADC_SHIFT );
+    return config;
+}
 
-    if ( get_voltage( &ma ) )
-    {
-        fprintf( stderr, "Error reading current\n" );
-        return;
+
+// Read registers (regs[ 0 ] must be BUS_REG) once a conversion is ready.
+// In triggered mode a conversion is started first.  Waits are derived
+// from the configured conversion time rather than a fixed delay.
+int read_conversion( ina_t *ina, const unsigned char *regs, unsigned short *data, int count )
+{
+    int poll_us = ina->conversion_us / 8;
+
+    if ( poll_us < 50 ) poll_us = 50;
+
+    if ( ( ina->config & CONFIG_MODE_MASK ) < 4 )
+    {
+        if ( register_write( ina, CONFIG_REG, ina->config ) != 0 )
+        {
+            return -1;
+        }
+        pu_sleep_us( ina->conversion_us );
     }
 
-    if ( get_current( &ma ) )
+    while ( 1 )
     {
-        fprintf( stderr, "Error reading current\n" );
+        if ( register_read_multi( ina, regs, data, count ) != 0 )
+        {
+            return -1;
+        }
+        if ( data[ 0 ] & BUS_CNVR )
+        {
+            break;
+        }
+        pu_sleep_us( poll_us );
+    }
+
+    return 0;
+}
+
+
+int get_voltage( ina_t *ina, float *mv )
+{
+    static const unsigned char regs[ 1 ] = { BUS_REG };
+    unsigned short bus;
+
+    if ( read_conversion( ina, regs, &bus, 1 ) != 0 )
+    {
+        return -1;
+    }
+
+    *mv = ( float )( ( bus & 0xFFF8 ) >> 1 );
+    return 0;
+}
+
+
+// Pick the smallest whole-microamp current LSB that covers the shunt range
+// of the given config, and the CALIBRATION_REG value that goes with it
+void calibration_setup( ina_t *ina, unsigned short config )
+{
+    double range_mv = 40 << ( ( config >> CONFIG_PG_SHIFT ) & 0x3 );
+    double lsb_ua;
+
+    lsb_ua = range_mv * 1000.0 / ina->shunt_ohms / 32768.0;
+    lsb_ua = ( lsb_ua < 1.0 ) ? 1.0 : (double)(long)( lsb_ua + 0.999 );
+
+    ina->current_lsb = lsb_ua / 1000.0;
+    ina->calibration = (unsigned short)( 0.04096 / ( lsb_ua * 1e-6 * ina->shunt_ohms ) ) & 0xFFFE;
+}
+
+
+int get_current( ina_t *ina, float *ma )
+{
+    unsigned short current;
+
+    if ( register_read( ina, CURRENT_REG, &current ) != 0 )
+    {
+        return -1;
+    }
+
+    *ma = (float)( (short)current * ina->current_lsb );
+    return 0;
+}
+
+
+// Auto-ranging: jump to the widest shunt range as soon as a conversion
+// overflows or nears full scale, and step back one range at a time once
+// readings have fit the narrower range for AUTOGAIN_HOLD conversions.
+// Returns 1 when *config was changed and written along with calibration.
+int autogain_update( ina_t *ina, unsigned short *config, unsigned short bus, short shunt )
+{
+    int pg = ( *config & CONFIG_PG_MASK ) >> CONFIG_PG_SHIFT;
+    int mag = abs( shunt );
+    int new_pg = pg;
+
+    if ( ( bus & BUS_OVF ) || ( mag >= ( SHUNT_FULL_SCALE << pg ) * AUTOGAIN_UP_PCT / 100 ) )
+    {
+        ina->autogain_low = 0;
+        new_pg = 3;
+    }
+    else if ( ( pg > 0 ) && ( mag < ( SHUNT_FULL_SCALE << ( pg - 1 ) ) * AUTOGAIN_DOWN_PCT / 100 ) )
+    {
+        if ( ++ina->autogain_low >= AUTOGAIN_HOLD )
+        {
+            ina->autogain_low = 0;
+            new_pg = pg - 1;
+        }
+    }
+    else
+    {
+        ina->autogain_low = 0;
+    }
+
+    if ( new_pg == pg )
+        return 0;
+
+    *config = ( *config & ~CONFIG_PG_MASK ) | ( new_pg << CONFIG_PG_SHIFT );
+    register_write( ina, CONFIG_REG, *config );
+    calibration_setup( ina, *config );
+    register_write( ina, CALIBRATION_REG, ina->calibration );
+
+    return 1;
+}
+
+
+// Bus and shunt are fetched together so both values come from the same
+// conversion once CNVR is seen
+int get_raw( ina_t *ina, unsigned short *bus, short *shunt )
+{
+    static const unsigned char regs[ 2 ] = { BUS_REG, SHUNT_REG };
+    unsigned short data[ 2 ];
+
+    if ( read_conversion( ina, regs, data, 2 ) != 0 )
+    {
+        return -1;
+    }
+
+    *bus = data[ 0 ];
+    *shunt = (short)data[ 1 ];
+
+    ina->sample_pg = ( ina->config & CONFIG_PG_MASK ) >> CONFIG_PG_SHIFT;
+    if ( autogain )
+    {
+        autogain_update( ina, &ina->config, data[ 0 ], (short)data[ 1 ] );
+    }
+    return 0;
+}
+
+
+// Current and power come from the chip's own multiplier.  Reading
+// POWER_REG clears CNVR so the next call waits for a fresh conversion.
+int get_voltage_current( ina_t *ina, float *mv, float *ma, float *mw )
+{
+    static const unsigned char regs[ 4 ] = { BUS_REG, CURRENT_REG, POWER_REG, SHUNT_REG };
+    unsigned short data[ 4 ];
+
+    if ( read_conversion( ina, regs, data, autogain ? 4 : 3 ) != 0 )
+    {
+        return -1;
+    }
+
+    *mv = ( float )( ( data[ 0 ] & 0xFFF8 ) >> 1 );
+    *ma = ( float )( (short)data[ 1 ] * ina->current_lsb );
+    if ( mw != NULL )
+    {
+        // POWER_REG is unsigned, follow the current's direction
+        *mw = ( float )( data[ 2 ] * ina->current_lsb * 20 );
+        if ( *ma < 0 ) *mw = -*mw;
+    }
+
+    // Values above were scaled with the calibration in effect for this
+    // conversion, so ranging can only change things afterwards
+    ina->sample_pg = ( ina->config & CONFIG_PG_MASK ) >> CONFIG_PG_SHIFT;
+    if ( autogain )
+    {
+        autogain_update( ina, &ina->config, data[ 0 ], (short)data[ 3 ] );
+    }
+    return 0;
+}
+
+
+// Work out the config and calibration for the requested settings
+void sensor_settings( ina_t *ina )
+{
+    ina->config = ina_config;
+    if ( adc_setting >= 0 )
+    {
+        ina->config = config_with_adc( ina->config, adc_setting );
+    }
+    ina->conversion_us = config_time_us( ina->config );
+    calibration_setup( ina, ina->config );
+}
+
+
+// Bring the chip in line with the sensor's settings, given what it holds
+// now.  Config goes last: writing it restarts the conversion and clears
+// CNVR, so nothing computed with an old calibration is read back.
+int sensor_program( ina_t *ina, unsigned short config, unsigned short calibration )
+{
+    if ( calibration != ina->calibration )
+    {
+        if ( register_write( ina, CALIBRATION_REG, ina->calibration ) != 0 )
+            return -1;
+    }
+
+    if ( ( config != ina->config ) || ( calibration != ina->calibration ) )
+    {
+        if ( register_write( ina, CONFIG_REG, ina->config ) != 0 )
+            return -1;
+    }
+
+    return 0;
+}
+
+
+// One-shot reads take a single batched transfer when the chip is already
+// converting continuously with our config and calibration: the result
+// registers then hold the last completed conversion and are used as is.
+// Anything else is reprogrammed and waits for a fresh conversion.
+int oneshot_read( ina_t *ina, float *mv, float *ma, float *mw )
+{
+    static const unsigned char regs[ 5 ] = { CONFIG_REG, CALIBRATION_REG, BUS_REG, CURRENT_REG, POWER_REG };
+    unsigned short data[ 5 ];
+
+    if ( register_read_multi( ina, regs, data, 5 ) != 0 )
+    {
+        return -1;
+    }
+
+    if ( ( data[ 0 ] == ina->config ) &&
+         ( data[ 1 ] == ina->calibration ) &&
+         ( ( ina->config & CONFIG_MODE_MASK ) == MODE_CONTINUOUS ) &&
+         ( data[ 2 ] != 0 ) && !( data[ 2 ] & BUS_OVF ) )
+    {
+        *mv = ( float )( ( data[ 2 ] & 0xFFF8 ) >> 1 );
+        *ma = ( float )( (short)data[ 3 ] * ina->current_lsb );
+        *mw = ( float )( data[ 4 ] * ina->current_lsb * 20 );
+        if ( *ma < 0 ) *mw = -*mw;
+        ina->sample_pg = ( ina->config & CONFIG_PG_MASK ) >> CONFIG_PG_SHIFT;
+        return 0;
+    }
+
+    if ( sensor_program( ina, data[ 0 ], data[ 1 ] ) != 0 )
+    {
+        return -1;
+    }
+
+    return get_voltage_current( ina, mv, ma, mw );
+}
+
+
+void energy_add( energy_t *e, uint64_t ns, float ma, float mw )
+{
+    if ( e->valid )
+    {
+        double hours = ( ns - e->last_ns ) / 3.6e12;
+
+        e->mah += ( e->last_ma + ma ) / 2 * hours;
+        e->mwh += ( e->last_mw + mw ) / 2 * hours;
+    }
+    else
+    {
+        e->valid = 1;
+        e->start_ns = ns;
+    }
+
+    e->last_ns = ns;
+    e->last_ma = ma;
+    e->last_mw = mw;
+}
+
+
+void energy_show( ina_t *ina, FILE *fp )
+{
+    energy_t *e = &ina->energy;
+
+    if ( !e->valid )
         return;
+
+    if ( sensor_count > 1 )
+    {
+        fprintf( fp, "%d:%02X ", ina->bus, ina->address );
+    }
+    fprintf( fp, "Energy over %.0f s: %.3f mAh  %.3f mWh\n",
+             ( e->last_ns - e->start_ns ) / 1e9, e->mah, e->mwh );
+}
+
+
+int show_current( ina_t *ina )
+{
+    float mv, ma, mw;
+
+    if ( oneshot_read( ina, &mv, &ma, &mw ) )
+    {
+        fprintf( stderr, "Error reading current\n" );
+        return -1;
     }
     
     if ( whole_numbers )
@@ -273,110 +1153,550 @@ void show_current( void )
     {
         printf( "%04.1f\n", ma );
     }
+    return 0;
+}
+
+
+int show_power( ina_t *ina )
+{
+    float mv, ma, mw;
+
+    if ( oneshot_read( ina, &mv, &ma, &mw ) )
+    {
+        fprintf( stderr, "Error reading power\n" );
+        return -1;
+    }
+    printf( "%4.0f\n", mw );
+    return 0;
 }
 
 
-void show_voltage( void )
+int show_voltage( ina_t *ina )
 {
-    float mv;
+    float mv, ma, mw;
 
-    if ( get_voltage( &mv ) )
+    if ( oneshot_read( ina, &mv, &ma, &mw ) )
     {
         fprintf( stderr, "Error reading voltage\n" );
-        return;
+        return -1;
     }
     printf( "%4.0f\n", mv );
+    return 0;
 }
 
 
-void show_voltage_current( void )
+// Print one sensor's reading, prefixed with bus:address when sampling
+// several sensors.  The caller ends the line.
+void print_voltage_current( ina_t *ina, float mv, float ma )
 {
-    float mv, ma;
-
-    if ( get_voltage( &mv ) || get_current( &ma ) )
+    if ( sensor_count > 1 )
     {
-        fprintf( stderr, "Error reading voltage/current\n" );
-        return;
+        printf( "%d:%02X ", ina->bus, ina->address );
     }
 
     if ( whole_numbers )
     {
-        printf( "%4.0fmV  %4.0fmA\n", mv, ma );
+        printf( "%4.0fmV  %4.0fmA", mv, ma );
     }
     else
     {
-        printf( "%4.0fmV  %4.1fmA\n", mv, ma );
+        printf( "%4.0fmV  %4.1fmA", mv, ma );
+    }
+
+    if ( autogain )
+    {
+        printf( "  /%d", 1 << ina->sample_pg );
     }
 }
 
 
-void monitor( void )
+int show_voltage_current( void )
+{
+    float mv, ma, mw;
+    int i;
+
+    for ( i = 0; i < sensor_count; i++ )
+    {
+        if ( oneshot_read( &sensors[ i ], &mv, &ma, &mw ) )
+        {
+            fprintf( stderr, "Error reading voltage/current\n" );
+            return -1;
+        }
+
+        print_voltage_current( &sensors[ i ], mv, ma );
+        printf( "\n" );
+    }
+    return 0;
+}
+
+
+// Take one monitor sample from a sensor into its latest-sample fields
+void monitor_sample( ina_t *ina )
+{
+    ina->valid = 0;
+
+    if ( capture_fd >= 0 )
+    {
+        if ( get_raw( ina, &ina->raw_bus, &ina->raw_shunt ) == 0 )
+        {
+            ina->ns = monotonic_ns();
+            ina->mv = ( ina->raw_bus & 0xFFF8 ) >> 1;
+            ina->ma = ina->raw_shunt * 0.01 / ina->shunt_ohms;
+            ina->mw = ina->ma * ina->mv / 1000;
+            ina->valid = 1;
+        }
+    }
+    else if ( get_voltage_current( ina, &ina->mv, &ina->ma, &ina->mw ) == 0 )
+    {
+        ina->ns = monotonic_ns();
+        ina->valid = 1;
+    }
+
+    if ( ina->valid )
+    {
+        energy_add( &ina->energy, ina->ns, ina->ma, ina->mw );
+    }
+}
+
+
+// Runs on whichever worker reaches the tick barrier last: emits the merged
+// record for the tick and schedules the next one.  Deadlines that have
+// already passed by a whole interval are skipped and counted.
+void monitor_emit( void )
 {
+    struct timespec wall;
     struct tm *tmptr;
-    time_t seconds;
+    uint64_t now;
+    int i;
+
+    if ( capture_fd >= 0 )
+    {
+        for ( i = 0; i < sensor_count; i++ )
+        {
+            if ( sensors[ i ].valid )
+            {
+                capture_write( sensors[ i ].ns, i, sensors[ i ].raw_bus, sensors[ i ].raw_shunt,
+                               tick_flags | ( sensors[ i ].sample_pg << CAP_FLAG_PG_SHIFT ) );
+            }
+            else fprintf( stderr, "Error reading voltage/current\n" );
+        }
+    }
+    else
+    {
+        clock_gettime( CLOCK_REALTIME, &wall );
+        tmptr = localtime( &wall.tv_sec );
+        if ( interval_ns < 1000000000ULL )
+        {
+            printf( "%2d:%02d:%02d.%03ld ", tmptr->tm_hour, tmptr->tm_min, tmptr->tm_sec, wall.tv_nsec / 1000000 );
+        }
+        else
+        {
+            printf( "%2d:%02d:%02d ", tmptr->tm_hour, tmptr->tm_min, tmptr->tm_sec );
+        }
+
+        for ( i = 0; i < sensor_count; i++ )
+        {
+            if ( i > 0 )
+            {
+                printf( "  " );
+            }
+
+            if ( sensors[ i ].valid )
+            {
+                print_voltage_current( &sensors[ i ], sensors[ i ].mv, sensors[ i ].ma );
+            }
+            else if ( sensor_count > 1 )
+            {
+                printf( "%d:%02X error", sensors[ i ].bus, sensors[ i ].address );
+            }
+            else fprintf( stderr, "Error reading voltage/current" );
+        }
+        printf( "\n" );
+        fflush( stdout );
+    }
+    tick_flags = 0;
+
+    now = monotonic_ns();
+    if ( now >= tick_report )
+    {
+        for ( i = 0; i < sensor_count; i++ )
+        {
+            energy_show( &sensors[ i ], ( capture_fd >= 0 ) ? stderr : stdout );
+        }
+        tick_report += energy_report_ns;
+    }
+
+    tick_deadline += interval_ns;
+    if ( now >= tick_deadline )
+    {
+        uint64_t skip = ( now - tick_deadline ) / interval_ns + 1;
+
+        tick_missed += skip;
+        tick_deadline += skip * interval_ns;
+        tick_flags = CAP_FLAG_MISSED;
+    }
+
+    tick_stop = !running;
+}
+
+
+// Each bus has its own worker so sensors on different buses are read in
+// parallel.  All workers sleep to the same absolute CLOCK_MONOTONIC tick,
+// sample their sensors and meet at a barrier, so records stay aligned and
+// read/print time never accumulates into drift.
+void *monitor_worker( void *arg )
+{
+    bus_worker_t *w = arg;
+    struct timespec ts;
+    uint64_t deadline, late;
+    int i, first = 1;
 
     while ( 1 )
     {
-        seconds = time( NULL );
-        tmptr = localtime( &seconds );
-        printf( "%2d:%02d:%02d ", tmptr->tm_hour, tmptr->tm_min, tmptr->tm_sec );
-        show_voltage_current();
-        sleep( interval );
+        deadline = tick_deadline;
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        // running is cleared under tick_lock before the broadcast, so a
+        // shutdown can't slip in between the test and the wait
+        pthread_mutex_lock( &tick_lock );
+        while ( running && ( pthread_cond_timedwait( &tick_wake, &tick_lock, &ts ) != ETIMEDOUT ) )
+            ;
+        pthread_mutex_unlock( &tick_lock );
+
+        if ( running && !first )
+        {
+            late = monotonic_ns() - deadline;
+            if ( late < w->late_min ) w->late_min = late;
+            if ( late > w->late_max ) w->late_max = late;
+            w->late_sum += late;
+            w->wakeups++;
+        }
+        first = 0;
+
+        for ( i = 0; i < w->count; i++ )
+        {
+            monitor_sample( w->sensors[ i ] );
+        }
+
+        if ( pthread_barrier_wait( &tick_barrier ) == PTHREAD_BARRIER_SERIAL_THREAD )
+        {
+            monitor_emit();
+        }
+        pthread_barrier_wait( &tick_barrier );
+
+        if ( tick_stop )
+            break;
     }
+
+    return NULL;
 }
 
 
-int main( int argc, char *argv[] )
+void monitor( void )
 {
+    bus_worker_t workers[ MAX_SENSORS ];
+    pthread_condattr_t attr;
+    sigset_t set;
+    uint64_t wakeups = 0, late_min = UINT64_MAX, late_max = 0;
+    double late_sum = 0;
+    int i, j, nworkers = 0, sig;
+
+    // Group sensors by bus, one worker each
+    memset( workers, 0, sizeof( workers ) );
+    for ( i = 0; i < sensor_count; i++ )
+    {
+        for ( j = 0; j < nworkers; j++ )
+        {
+            if ( workers[ j ].bus == sensors[ i ].bus )
+                break;
+        }
+        if ( j == nworkers )
+        {
+            workers[ j ].bus = sensors[ i ].bus;
+            workers[ j ].late_min = UINT64_MAX;
+            nworkers++;
+        }
+        workers[ j ].sensors[ workers[ j ].count++ ] = &sensors[ i ];
+    }
+
+    if ( capture_name && ( capture_open( sensors[ 0 ].config, interval_ns, sensor_count ) != 0 ) )
+        return;
+
+    // Workers inherit a mask blocking SIGINT/SIGTERM, the main thread
+    // collects those with sigwait() and wakes the workers through tick_wake
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &tick_wake, &attr );
+    pthread_condattr_destroy( &attr );
+
+    sigemptyset( &set );
+    sigaddset( &set, SIGINT );
+    sigaddset( &set, SIGTERM );
+    pthread_sigmask( SIG_BLOCK, &set, NULL );
+
+    tick_deadline = monotonic_ns();
+    tick_report = tick_deadline + energy_report_ns;
+    pthread_barrier_init( &tick_barrier, NULL, nworkers );
+
+    for ( i = 0; i < nworkers; i++ )
+    {
+        if ( pthread_create( &workers[ i ].thread, NULL, monitor_worker, &workers[ i ] ) != 0 )
+        {
+            fprintf( stderr, "Error starting worker for bus %d\n", workers[ i ].bus );
+            exit( 1 );
+        }
+    }
+
+    sigwait( &set, &sig );
+    pthread_mutex_lock( &tick_lock );
+    running = 0;
+    pthread_cond_broadcast( &tick_wake );
+    pthread_mutex_unlock( &tick_lock );
+
+    for ( i = 0; i < nworkers; i++ )
+    {
+        pthread_join( workers[ i ].thread, NULL );
+
+        wakeups += workers[ i ].wakeups;
+        late_sum += workers[ i ].late_sum;
+        if ( workers[ i ].late_min < late_min ) late_min = workers[ i ].late_min;
+        if ( workers[ i ].late_max > late_max ) late_max = workers[ i ].late_max;
+    }
+    pthread_barrier_destroy( &tick_barrier );
+    pthread_cond_destroy( &tick_wake );
+
+    capture_close();
+
+    for ( i = 0; i < sensor_count; i++ )
+    {
+        energy_show( &sensors[ i ], stderr );
+    }
+    if ( wakeups )
+    {
+        fprintf( stderr, "\n%llu intervals, %llu missed deadlines, wakeup jitter min %.3f / avg %.3f / max %.3f ms\n",
+                 (unsigned long long)( wakeups / nworkers ), (unsigned long long)tick_missed,
+                 late_min / 1e6, late_sum / wakeups / 1e6, late_max / 1e6 );
+    }
+}
+
+
+// Capture samples back to back at the ADC conversion rate.  POWER_REG is
+// read along with bus and shunt purely to clear CNVR, so each conversion
+// is stored exactly once.
+void burst( ina_t *ina )
+{
+    static const unsigned char regs[ 3 ] = { BUS_REG, SHUNT_REG, POWER_REG };
+    unsigned short data[ 3 ];
     unsigned short config;
+    sample_t *samples;
+    uint64_t start, deadline, now;
+    int i, count = 0;
+    short min, max;
 
-    char filename[ 20 ];
+    // Single 12-bit samples unless an ADC setting was given, always continuous
+    config = config_with_adc( ina->config, ( adc_setting < 0 ) ? ADC_12BIT : adc_setting );
+    config = ( config & ~CONFIG_MODE_MASK ) | MODE_CONTINUOUS;
 
-    parse( argc, argv );
+    if ( burst_ns )
+    {
+        burst_count = ( burst_ns / ( config_time_us( config ) * 1000ULL ) ) + 16;
+        if ( burst_count > BURST_MAX_SAMPLES )
+        {
+            fprintf( stderr, "Burst limited to %d samples.\n", BURST_MAX_SAMPLES );
+            return;
+        }
+    }
+
+    samples = calloc( burst_count, sizeof( sample_t ) );
+    if ( samples == NULL )
+    {
+        fprintf( stderr, "Error allocating sample buffer\n" );
+        return;
+    }
+
+    register_write( ina, CONFIG_REG, config );
 
-    snprintf( filename, 19, "/dev/i2c-%d", i2c_bus );
-    handle = open( filename, O_RDWR );
-    if ( handle < 0 ) 
+    start = monotonic_ns();
+    deadline = burst_ns ? start + burst_ns : 0;
+
+    while ( count < burst_count )
     {
-        fprintf( stderr, "Error opening bus %d: %s\n", i2c_bus, strerror( errno ) );
-        exit( 1 );
+        if ( register_read_multi( ina, regs, data, 3 ) != 0 )
+        {
+            fprintf( stderr, "Error reading voltage/current\n" );
+            break;
+        }
+
+        now = monotonic_ns();
+        if ( deadline && ( now >= deadline ) )
+            break;
+
+        if ( data[ 0 ] & BUS_CNVR )
+        {
+            samples[ count ].ns = now;
+            samples[ count ].bus = data[ 0 ];
+            samples[ count ].shunt = (short)data[ 1 ];
+            samples[ count ].pg = ( config & CONFIG_PG_MASK ) >> CONFIG_PG_SHIFT;
+            count++;
+
+            if ( autogain )
+            {
+                autogain_update( ina, &config, data[ 0 ], (short)data[ 1 ] );
+            }
+        }
     }
 
-    if ( ioctl( handle, I2C_SLAVE, i2c_address ) < 0 ) 
+    register_write( ina, CONFIG_REG, ina->config );
+    if ( autogain )
     {
-        fprintf( stderr, "Error setting address %02X: %s\n", i2c_address, strerror( errno ) );
-        exit( 1 );
+        calibration_setup( ina, ina->config );
+        register_write( ina, CALIBRATION_REG, ina->calibration );
     }
 
-    if ( register_read( CONFIG_REG, &config ) < 0 )
+    if ( count == 0 )
     {
-        fprintf( stderr, "Error accessing INA219\n" );
-        exit( 1 );
+        free( samples );
+        return;
     }
-    
-    if ( config != 0x25DF )  // Gain x1, 8 sample avg
+
+    if ( capture_name && ( capture_open( config, 0, 1 ) != 0 ) )
+    {
+        free( samples );
+        return;
+    }
+
+    min = max = samples[ 0 ].shunt;
+    for ( i = 0; i < count; i++ )
+    {
+        uint64_t t = samples[ i ].ns - samples[ 0 ].ns;
+
+        if ( samples[ i ].shunt < min ) min = samples[ i ].shunt;
+        if ( samples[ i ].shunt > max ) max = samples[ i ].shunt;
+
+        if ( capture_fd >= 0 )
+        {
+            capture_write( samples[ i ].ns, 0, samples[ i ].bus, samples[ i ].shunt,
+                           samples[ i ].pg << CAP_FLAG_PG_SHIFT );
+            continue;
+        }
+
+        printf( "%llu.%06llu %4dmV  %4.1fmA  /%d%s\n",
+                (unsigned long long)( t / 1000000000ULL ),
+                (unsigned long long)( ( t % 1000000000ULL ) / 1000 ),
+                ( samples[ i ].bus & 0xFFF8 ) >> 1,
+                samples[ i ].shunt * 0.01 / ina->shunt_ohms,
+                1 << samples[ i ].pg,
+                ( samples[ i ].bus & BUS_OVF ) ? " OVF" : "" );
+    }
+
+    capture_close();
+
+    now = samples[ count - 1 ].ns - samples[ 0 ].ns;
+    fprintf( stderr, "%d samples in %.3f ms (%.0f samples/s), current %.1f to %.1f mA\n",
+             count, now / 1e6, ( count > 1 ) ? ( count - 1 ) * 1e9 / now : 0.0,
+             min * 0.01 / ina->shunt_ohms, max * 0.01 / ina->shunt_ohms );
+
+    free( samples );
+}
+
+
+// Open the sensor's bus.  With setup set, also bring its config and
+// calibration registers in line with the requested settings; one-shot
+// reads leave that to oneshot_read() so they can skip it when possible.
+int sensor_open( ina_t *ina, int setup )
+{
+    static const unsigned char regs[ 2 ] = { CONFIG_REG, CALIBRATION_REG };
+    unsigned short data[ 2 ];
+    int rc;
+
+    rc = pu_open( &ina->dev, ina->bus, ina->address );
+    if ( rc == PU_ERR_OPEN )
+    {
+        fprintf( stderr, "Error opening bus %d: %s\n", ina->bus, strerror( ina->dev.errnum ) );
+        return -1;
+    }
+    else if ( rc == PU_ERR_ADDRESS )
+    {
+        fprintf( stderr, "Error setting address %02X: %s\n", ina->address, strerror( ina->dev.errnum ) );
+        return -1;
+    }
+    else if ( rc != PU_OK )
+    {
+        fprintf( stderr, "Error opening %d:%02X: %s\n", ina->bus, ina->address, pu_strerror( rc ) );
+        return -1;
+    }
+
+    sensor_settings( ina );
+
+    if ( !setup )
+        return 0;
+
+    if ( ( register_read_multi( ina, regs, data, 2 ) < 0 ) ||
+         ( sensor_program( ina, data[ 0 ], data[ 1 ] ) < 0 ) )
+    {
+        fprintf( stderr, "Error accessing INA219 at %d:%02X\n", ina->bus, ina->address );
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int main( int argc, char *argv[] )
+{
+    uint64_t start, opened;
+    int i, transfers = 0;
+    int rc = 0;
+
+    start = monotonic_ns();
+
+    parse( argc, argv );
+
+    if ( operation == OP_EXPORT )
     {
-        register_write( CONFIG_REG, 0x25DF );
-        msleep( 10 );
+        return capture_export();
     }
 
+    if ( sensor_count == 0 )
+    {
+        sensors[ 0 ].bus = i2c_bus;
+        sensors[ 0 ].address = i2c_address;
+        sensors[ 0 ].shunt_ohms = shunt_ohms;
+        sensor_count = 1;
+    }
+
+    for ( i = 0; i < sensor_count; i++ )
+    {
+        if ( sensor_open( &sensors[ i ], ( operation == OP_MONITOR ) || ( operation == OP_BURST ) ) != 0 )
+        {
+            exit( 1 );
+        }
+    }
+    opened = monotonic_ns();
+
     switch ( operation )
     {
         case OP_DUMP:
         {
-            show_voltage_current();
+            rc = ( show_voltage_current() != 0 );
             break;
         }
 
         case OP_VOLTAGE:
         {
-            show_voltage();
+            rc = ( show_voltage( &sensors[ 0 ] ) != 0 );
             break;
         }
 
         case OP_CURRENT:
         {
-            show_current();
+            rc = ( show_current( &sensors[ 0 ] ) != 0 );
+            break;
+        }
+
+        case OP_POWER:
+        {
+            rc = ( show_power( &sensors[ 0 ] ) != 0 );
             break;
         }
 
@@ -386,6 +1706,12 @@ int main( int argc, char *argv[] )
             break;
         }
 
+        case OP_BURST:
+        {
+            burst( &sensors[ 0 ] );
+            break;
+        }
+
         default:
         case OP_NONE:
         {
@@ -393,7 +1719,19 @@ int main( int argc, char *argv[] )
         }
     }
 
-    close( handle );
-    return 0;
+    for ( i = 0; i < sensor_count; i++ )
+    {
+        transfers += sensors[ i ].dev.transfers;
+        pu_close( &sensors[ i ].dev );
+    }
+
+    if ( show_timing )
+    {
+        uint64_t end = monotonic_ns();
+
+        fprintf( stderr, "Latency %.3f ms (open %.3f ms, read %.3f ms), %d I2C transfers\n",
+                 ( end - start ) / 1e6, ( opened - start ) / 1e6, ( end - opened ) / 1e6, transfers );
+    }
+    return rc;
 }
 
@@ -9,14 +9,24 @@
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
 #include <fcntl.h>
-#include <linux/i2c-dev.h>
-#include "regs.h"
+#include <pthread.h>
+#include "powerutils.h"
 
 #define BLOCK_I2C_WRITE     16
-#define I2C_DELAY_MS        50
+
+#define BOOT_TIMEOUT_MS     250         // longest a page erase/program may take
+#define BOOT_POLL_US        200
+#define BOOT_RETRIES        4           // attempts per page, backing off between
+#define BOOT_RETRY_MS       20
+
+#define CMD_TIMEOUT_MS      1000
+#define CMD_HIST_BUCKETS    14          // <64us, <128us ... <262ms, longer
 
 #define STM_ADDRESS         0x60
 #define INA_ADDRESS         0x40
@@ -24,6 +34,7 @@
 typedef unsigned char       uint8_t;
 typedef unsigned short      uint16_t;
 typedef unsigned int        uint32_t;
+typedef unsigned long long  uint64_t;
 
 typedef enum
 {
@@ -47,6 +58,8 @@ typedef enum
     OP_VALUE,
     OP_EXT_POWER,
 	OP_POWERDOWN_WDT,
+    OP_DAEMON,
+    OP_APPLY,
 } op_type;
 
 op_type operation = OP_NONE;
@@ -58,225 +71,332 @@ char *oper_arg = NULL;
  int i2c_bus = 1;
 #endif
 int stm_address = STM_ADDRESS;
+pu_dev_t stm;
+
+// Board the helpers below work on, per thread so a fleet upload can
+// drive each bus from its own
+__thread pu_dev_t *board = &stm;
 int new_address = 0;
 int charge_rate = 1;
 int power_timeout = 0;
 int calibration_value = 0;
-int handle = 0;
+int command_timeout_ms = CMD_TIMEOUT_MS;
+int show_stats = 0;
+
+#define BATCH_MAX           64
+#define SCRIPT_MAX_ARGS     8
+
+// Each operation option queues a step with the settings it was given, so
+// several operations run in order on one open board
+typedef struct
+{
+    op_type     operation;
+    char       *oper_arg;
+    char       *filename;
+    int         charge_rate;
+    int         power_timeout;
+    int         calibration_value;
+    int         new_address;
+} batch_op_t;
+
+batch_op_t batch[ BATCH_MAX ];
+int batch_count = 0;
+int keep_going = 0;
+int parse_failed = 0;
+char *script_name = NULL;
+int script_line = 0;
+
+typedef enum
+{
+    CFG_START,
+    CFG_RATE,
+    CFG_RESTART,
+    CFG_RTC_CAL,
+    CFG_WDT_POWER,
+    CFG_WDT_STOP,
+    CFG_WDT_START,
+    CFG_ADDRESS,
+    CFG_COUNT
+} config_item_t;
+
+// Order here is the order settings are applied, the address goes last
+const struct
+{
+    const char *name;
+    int         persistent;     // kept in EEPROM by COMMAND_EEPROM_STORE
+    int         min, max;
+} config_items[ CFG_COUNT ] = {
+    { "start",          1,  0,      START_ALL   },
+    { "charge-rate",    1,  1,      3           },
+    { "restart-time",   1,  0,      0x7FFFFFFF  },
+    { "rtc-calibration",1,  -511,   512         },
+    { "wdt-power",      0,  0,      255         },
+    { "wdt-stop",       0,  0,      255         },
+    { "wdt-start",      0,  0,      255         },
+    { "i2c-address",    1,  0x08,   0x77        },
+};
+
+typedef struct
+{
+    int         value[ CFG_COUNT ];
+    int         set[ CFG_COUNT ];
+} board_config_t;
+
+int dry_run = 0;
+
+typedef struct
+{
+    uint32_t    count;
+    uint32_t    min_us;
+    uint32_t    max_us;
+    uint32_t    total_us;
+    uint32_t    hist[ CMD_HIST_BUCKETS ];
+} cmd_stats_t;
+
+cmd_stats_t cmd_stats[ 256 ];
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define MAX_IMAGE_SIZE      ( 1024 * 16 )
 #define FLASH_PAGE_SIZE     ( 128 )
 #define HALF_PAGE_SIZE      ( FLASH_PAGE_SIZE / 2 )
+#define NUM_PAGES           ( MAX_IMAGE_SIZE / FLASH_PAGE_SIZE )
+#define MANIFEST_DIR        "/var/lib/powerutils"   // PU_STATE_DIR overrides
 char *filename;
 int  filehandle;
+int  full_upload = 0;
+int  resume_upload = 0;
 
+#define DAEMON_SOCKET       "/run/power-%d-%02X.sock"
+#define DAEMON_REFRESH_MS   1000
+#define DAEMON_CLIENTS      16
 
-void msleep ( int msecs )
+typedef struct
 {
-    usleep ( msecs * 1000 );
-}
+    uint8_t     regs[ NUM_REGISTERS ];
+    uint8_t     charge_rate;
+    uint32_t    restart_time;
+    uint32_t    ontime;
+    uint32_t    offtime;
+    uint32_t    refreshed_us;
+} board_state_t;
+
+typedef struct
+{
+    int         fd;
+    int         len;            // bytes buffered, -1 once the client is gone
+    int         hold;           // client is using the bus directly
+    char        buf[ 128 ];
+} daemon_client_t;
 
+int daemon_refresh_ms = DAEMON_REFRESH_MS;
+volatile sig_atomic_t daemon_running = 1;
 
-int i2c_read ( void *buf, int len )
+#define FLEET_MAX           32
+#define FLEET_REFRESH_MS    500
+
+typedef enum
 {
-    int rc = 0;
+    FLEET_WAITING,
+    FLEET_ERASE,
+    FLEET_PROG_LO,
+    FLEET_PROG_HI,
+    FLEET_DONE,
+    FLEET_FAILED,
+} fleet_state_t;
+
+typedef struct
+{
+    int             bus;
+    int             address;
+    uint32_t        serial;
+    int             have_serial;
+    fleet_state_t   state;
+    int             busy;           // flash command issued, not yet complete
+    int             page;
+    int             attempt;
+    int             retries;
+    uint32_t        issued_us;
+    uint32_t        resume_us;      // retry backoff, don't issue before this
+    uint32_t        start_us;
+    uint32_t        elapsed_us;
+    int             written, unchanged;
+    uint64_t        old[ NUM_PAGES ];
+    uint8_t         known[ NUM_PAGES ];
+    pu_dev_t        dev;
+} fleet_target_t;
+
+fleet_target_t fleet[ FLEET_MAX ];
+int fleet_count = 0;
+pthread_mutex_t fleet_lock = PTHREAD_MUTEX_INITIALIZER;
+uint8_t *fleet_image;
+int fleet_image_size;
+int fleet_pages;
+uint64_t fleet_hashes[ NUM_PAGES ];
 
-    if ( read ( handle, buf, len ) != len )
-    {
-        fprintf ( stderr, "I2C read failed: %s\n", strerror ( errno ) );
-        rc = -1;
-    }
 
-    return rc;
+void msleep ( int msecs )
+{
+    pu_sleep_us( msecs * 1000 );
 }
 
 
-int i2c_write( void *buf, int len )
+// The bus work is done by libpowerutils, these wrappers report its errors
+// the way the tool always has and hand back 0/-1 to the callers below
+int board_error( int rc )
 {
-    int rc = 0;
-
-    if ( write( handle, buf, len ) != len )
+    if ( rc == PU_ERR_IO )
+    {
+        fprintf( stderr, "I2C transfer failed: %s\n", strerror( board->errnum ) );
+    }
+    else if ( rc == PU_ERR_UNSTABLE )
     {
-        fprintf( stderr, "I2C write failed: %s\n", strerror ( errno ) );
-        rc = -1;
+        fprintf( stderr, "%s\n", pu_strerror( rc ) );
     }
 
-    return rc;
+    return ( rc == PU_OK ) ? 0 : -1;
 }
 
 
-int register_read( unsigned char reg, unsigned char *data )
+int board_open( pu_dev_t *dev, int bus, int address )
 {
-    int rc = -1;
-    unsigned char bite[ 4 ];
+    int rc = pu_open( dev, bus, address );
 
-    bite[ 0 ] = reg;
-    if ( i2c_write( bite, 1 ) == 0 )
+    if ( rc == PU_ERR_OPEN )
     {
-        if ( i2c_read( bite, 1 ) == 0 )
-        {
-            *data = bite[ 0 ];
-            rc = 0;
-        }
+        fprintf( stderr, "Error opening device /dev/i2c-%d: %s\n", bus, strerror( dev->errnum ) );
+    }
+    else if ( rc == PU_ERR_ADDRESS )
+    {
+        fprintf( stderr, "IOCTL Error: %s\n", strerror( dev->errnum ) );
+    }
+    else if ( rc != PU_OK )
+    {
+        fprintf( stderr, "%s\n", pu_strerror( rc ) );
     }
 
-    return rc;
+    return ( rc == PU_OK ) ? 0 : -1;
 }
 
 
-// TODO: Figure out why I can't block read on the Pi
-#if 0
-int register32_read( unsigned char reg, unsigned int *data )
+int register_read( unsigned char reg, unsigned char *data )
 {
-    int rc = -1;
-    unsigned char bite[ 4 ];
+    return board_error( pu_reg8_read( board, reg, data ) );
+}
 
-    bite[ 0 ] = reg;
-    if ( i2c_write( bite, 1 ) == 0 )
-    {
-        if ( i2c_read( data, 4 ) == 0 )
-        {
-            rc = 0;
-        }
-    }
 
-    return rc;
+int register_read_multi( const uint8_t *regs, uint8_t *data, int count )
+{
+    return board_error( pu_reg8_read_multi( board, regs, data, count ) );
 }
-#endif
 
 
-int data32_read( uint32_t *data )
+int register_snapshot( uint8_t *map )
 {
-    int i;
-    uint8_t bite;
+    return board_error( pu_stm_snapshot( board, map ) );
+}
 
-    *data = 0;
-    
-    for ( i = 0; i < 4; i++ )
-    {
-        bite = REG_DATA_3 - i;
-        if ( i2c_write( &bite, 1 ) == 0 )
-        {
-            if ( i2c_read( &bite, 1 ) == 0 )
-            {
-                *data <<= 8;
-                *data |= bite;
-            }
-            else return -1;
-        }
-        else return -1;
-    }
 
-    return 0;
+int data32_read( uint32_t *data )
+{
+    return board_error( pu_stm_data32_read( board, data ) );
 }
 
 
 int data32_write( uint32_t data )
 {
-    int i;
-    uint8_t bite[ 2 ];
+    return board_error( pu_stm_data32_write( board, data ) );
+}
 
-    for ( i = 0; i < 4; i++ )
-    {
-        bite[ 0 ] = REG_DATA_0 + i;
-        bite[ 1 ] = data & 0xFF;
-        data >>= 8;
-        if ( i2c_write( &bite, 2 ) != 0 )
-        {
-            return -1;
-        }
-    }
 
-    return 0;
+int register_write( unsigned char reg, unsigned char data )
+{
+    return board_error( pu_reg8_write( board, reg, data ) );
 }
 
 
-int register_write( unsigned char reg, unsigned char data )
+int register_block_write( unsigned char reg, unsigned char *data, unsigned char len )
 {
-    int rc = -1;
-    unsigned char bite[ 4 ];
+    if ( len > BLOCK_I2C_WRITE )
+        return -1;
 
-    bite[ 0 ] = reg;
-    bite[ 1 ] = data;
+    return board_error( pu_reg8_block_write( board, reg, data, len ) );
+}
 
-    if ( i2c_write( bite, 2 ) == 0 )
-    {
-        rc = 0;
-    }
 
-    return rc;
+void command_record( uint8_t command, uint32_t us )
+{
+    cmd_stats_t *st = &cmd_stats[ command ];
+    int b = 0;
+
+    while ( ( b < CMD_HIST_BUCKETS - 1 ) && ( us >= ( 64u << b ) ) )
+        b++;
+
+    pthread_mutex_lock( &stats_lock );
+    if ( ( st->count == 0 ) || ( us < st->min_us ) ) st->min_us = us;
+    if ( us > st->max_us ) st->max_us = us;
+    st->total_us += us;
+    st->count++;
+    st->hist[ b ]++;
+    pthread_mutex_unlock( &stats_lock );
 }
 
 
-int register_block_write( unsigned char reg, unsigned char *data, unsigned char len )
+// Returns the controller's REG_COMMAND value, 0 once the command is done
+int command_wait( uint8_t command )
 {
-    int i;
-    int rc = -1;
-    unsigned char bites[ BLOCK_I2C_WRITE+1 ];
+    int rc;
 
-    if ( len > BLOCK_I2C_WRITE )
-        return rc;
-    
-    bites[ 0 ] = reg;
-    for ( i=0; i<len; i++ )
-    {
-        bites[ i+1 ] = *data++;
-    }
+    board->command_timeout_ms = command_timeout_ms;
+    rc = pu_stm_command( board, command );
 
-    if ( i2c_write( bites, len+1 ) == 0 )
+    if ( ( rc == PU_ERR_IO ) || ( rc == PU_ERR_ADDRESS ) )
     {
-        rc = 0;
+        board_error( rc );
+        return board->command_status ? board->command_status : 0xEE;
     }
 
-    return rc;
-}
+    command_record( command, board->command_us );
 
+    if ( rc == PU_ERR_TIMEOUT )
+    {
+        fprintf( stderr, "Command %02X timed out after %d ms\n", command, command_timeout_ms );
+    }
 
-int command_wait( uint8_t command )
-{
-    uint8_t r = 0xEE;
-    
-    if ( register_write( REG_COMMAND, command ) == 0 )
+    switch ( board->command_status )
     {
-        do {
-            msleep( 1 );
-            if ( register_read( REG_COMMAND, &r ) != 0 )
-                break;
-        } while ( r == command );
-        
-        switch ( r )
+        case 0xEA:
         {
-            case 0xEA:
-            {
-                fprintf( stderr, "Command error: invalid address\n" );
-                break;
-            }
-            case 0xEC:
-            {
-                fprintf( stderr, "Command error: invalid command\n" );
-                break;
-            }
-            case 0xEE:
-            {
-                fprintf( stderr, "Command or state error\n" );
-                break;
-            }
-            default:
-            case 0:
-            {
-                break;
-            }
+            fprintf( stderr, "Command error: invalid address\n" );
+            break;
+        }
+        case 0xEC:
+        {
+            fprintf( stderr, "Command error: invalid command\n" );
+            break;
+        }
+        case 0xEE:
+        {
+            fprintf( stderr, "Command or state error\n" );
+            break;
+        }
+        default:
+        case 0:
+        {
+            break;
         }
     }
-    
-    return (int)r;
+
+    return board->command_status;
 }
 
 
+// The command and its data go out under the board's lock so other
+// threads using the same board can't slip in between
 int command_read8( uint8_t command, uint8_t *data )
 {
     int rc = -1;
-    
+
+    pu_lock( board );
     if ( command_wait( command ) == 0 )
     {
         if ( register_read( REG_DATA_0, data ) == 0 )
@@ -284,7 +404,8 @@ int command_read8( uint8_t command, uint8_t *data )
             rc = 0;
         }
     }
-    
+    pu_unlock( board );
+
     return rc;
 }
 
@@ -292,7 +413,8 @@ int command_read8( uint8_t command, uint8_t *data )
 int command_read32( uint8_t command, uint32_t *data )
 {
     int rc = -1;
-    
+
+    pu_lock( board );
     if ( command_wait( command ) == 0 )
     {
         if ( data32_read( data ) == 0 )
@@ -300,7 +422,8 @@ int command_read32( uint8_t command, uint32_t *data )
             rc = 0;
         }
     }
-    
+    pu_unlock( board );
+
     return rc;
 }
 
@@ -308,7 +431,8 @@ int command_read32( uint8_t command, uint32_t *data )
 int command_write32( uint8_t command, uint32_t data )
 {
     int rc = -1;
-    
+
+    pu_lock( board );
     if ( data32_write( data ) == 0 )
     {
         if ( command_wait( command ) == 0 )
@@ -316,6 +440,7 @@ int command_write32( uint8_t command, uint32_t data )
             rc = 0;
         }
     }
+    pu_unlock( board );
 
     return rc;
 }
@@ -323,18 +448,14 @@ int command_write32( uint8_t command, uint32_t data )
 
 int verify_product( void )
 {
-    int rc = 0;
-    uint8_t c;
-    
-    if ( register_read( REG_ID, &c ) == 0 )
+    int rc = pu_stm_verify( board );
+
+    if ( rc != PU_ERR_NODEV )
     {
-        if ( c == 0xED ) 
-        {
-            rc = 1;
-        }
+        board_error( rc );
     }
-    
-    return rc;
+
+    return ( rc == PU_OK ) ? 1 : 0;
 }
 
 
@@ -406,7 +527,7 @@ int cape_write_rtc( void )
 
     // Align close to system second
     gettimeofday( &t, NULL );
-    usleep( 999999 - t.tv_usec );
+    pu_sleep_us( 999999 - t.tv_usec );
     gettimeofday( &t, NULL );
     
     if ( command_write32( COMMAND_WRITE_COUNT, t.tv_sec ) == 0 )
@@ -424,38 +545,27 @@ int cape_write_rtc( void )
 int cape_show_cape_info( void )
 {
     uint8_t c;
-    uint8_t product, step, revision;
-    uint8_t ver_maj, ver_min;
+    uint8_t map[ NUM_REGISTERS ];
     uint32_t time, d;
     
-    if ( register_read( REG_PROD, &product ) == 0 )
-    {
-        printf( "\nProduct      : " );
-        if ( product == PROD_POWERCAPE ) printf( "PowerCape" );
-        else if ( product == PROD_POWERHAT ) printf( "PowerHAT" );
-        else if ( product == PROD_POWERMODULE ) printf( "Power Module" );
-        else printf( "Unknown" );
-        printf( "\n" );
-    }
-    else return -1;
-    
-    if ( register_read( REG_STEP, &step ) != 0 )
+    // Everything held in registers comes from one snapshot, only the
+    // values behind commands cost extra transactions
+    if ( register_snapshot( map ) != 0 )
         return -1;
+
+    printf( "\nProduct      : " );
+    if ( map[ REG_PROD ] == PROD_POWERCAPE ) printf( "PowerCape" );
+    else if ( map[ REG_PROD ] == PROD_POWERHAT ) printf( "PowerHAT" );
+    else if ( map[ REG_PROD ] == PROD_POWERMODULE ) printf( "Power Module" );
+    else printf( "Unknown" );
+    printf( "\n" );
     
-    if ( register_read( REG_REVISION, &revision ) == 0 )
+    if ( isprint( map[ REG_STEP ] ) && isprint( map[ REG_REVISION ] ) )
     {
-        if ( isprint( step ) && isprint( revision ) )
-        {
-            printf( "HW Revision  : %c%c\n", step, revision );
-        }
+        printf( "HW Revision  : %c%c\n", map[ REG_STEP ], map[ REG_REVISION ] );
     }
-    else return -1;
     
-    if ( register_read( REG_VERSION_MAJOR, &ver_maj ) != 0 )
-        return -1;
-    if ( register_read( REG_VERSION_MINOR, &ver_min ) != 0 )
-        return -1;
-    printf( "Interface    : v%d.%d\n", ver_maj, ver_min );
+    printf( "Interface    : v%d.%d\n", map[ REG_VERSION_MAJOR ], map[ REG_VERSION_MINOR ] );
 
     if ( command_read32( COMMAND_GET_SERIAL, &d ) == 0 )
     {
@@ -511,68 +621,62 @@ int cape_show_cape_info( void )
     }
     else return -1;    
 
-    if ( register_read( REG_STATUS, &c ) == 0 )
+    c = map[ REG_STATUS ];
+    printf( "Status       : " );
+    if ( c == 0 ) 
     {
-        printf( "Status       : " );
-        if ( c == 0 ) 
-        {
-            printf( "none " );
-        }
-        else
-        {
-            if ( c & STATUS_POWER_GOOD ) printf( "PGOOD " );
-            if ( c & STATUS_BUTTON ) printf( "BUTTON " );
-            if ( c & STATUS_OPTO ) printf( "OPTO " );
-            if ( c & STATUS_LED ) printf( "LED " );
-            if ( c & STATUS_EXT_POWER ) printf( "EXT_PWR" );
-        }
-        printf ( "\n\n" );
+        printf( "none " );
+    }
+    else
+    {
+        if ( c & STATUS_POWER_GOOD ) printf( "PGOOD " );
+        if ( c & STATUS_BUTTON ) printf( "BUTTON " );
+        if ( c & STATUS_OPTO ) printf( "OPTO " );
+        if ( c & STATUS_LED ) printf( "LED " );
+        if ( c & STATUS_EXT_POWER ) printf( "EXT_PWR" );
     }
-    else return -1;
+    printf ( "\n\n" );
     
-    if ( register_read( REG_START_REASON, &c ) == 0 )
+    c = map[ REG_START_REASON ];
+    printf( "Power on triggered by " );
+    if ( c == 0 ) 
     {
-        printf( "Power on triggered by " );
-        if ( c == 0 ) 
-        {
-            printf( "nothing " );
-        }
-        else
-        {
-            if ( c & START_BUTTON ) printf( "button press " );
-            if ( c & START_EXTERNAL ) printf( "external event " );
-            if ( c & START_PWRGOOD ) printf( "power good " );
-            if ( c & START_TIMEOUT ) printf( "timer " );
-            if ( c & START_PWR_ON ) printf( "inital power " );
-            if ( c & START_WDT_RESET ) printf( "watchdog reset " );
-        }
-        printf ( "\n\n" );
+        printf( "nothing " );
+    }
+    else
+    {
+        if ( c & START_BUTTON ) printf( "button press " );
+        if ( c & START_EXTERNAL ) printf( "external event " );
+        if ( c & START_PWRGOOD ) printf( "power good " );
+        if ( c & START_TIMEOUT ) printf( "timer " );
+        if ( c & START_PWR_ON ) printf( "inital power " );
+        if ( c & START_WDT_RESET ) printf( "watchdog reset " );
     }
-    else return -1;
+    printf ( "\n\n" );
 
     return 0;
 }
 
 
-int get_enable_mask( uint8_t *mask )
+int get_enable_mask( const char *name, uint8_t *mask )
 {
-    if ( strcasecmp( oper_arg, "button" ) == 0 )
+    if ( strcasecmp( name, "button" ) == 0 )
     {
         *mask = START_BUTTON;        
     }
-    else if ( strcasecmp( oper_arg, "opto" ) == 0 )
+    else if ( strcasecmp( name, "opto" ) == 0 )
     {
         *mask = START_EXTERNAL;        
     }
-    else if ( strcasecmp( oper_arg, "pgood" ) == 0 )
+    else if ( strcasecmp( name, "pgood" ) == 0 )
     {
         *mask = START_PWRGOOD;        
     }
-    else if ( strcasecmp( oper_arg, "timeout" ) == 0 )
+    else if ( strcasecmp( name, "timeout" ) == 0 )
     {
         *mask = START_TIMEOUT;        
     }
-    else if ( strcasecmp( oper_arg, "poweron" ) == 0 )
+    else if ( strcasecmp( name, "poweron" ) == 0 )
     {
         *mask = START_PWR_ON;
     }
@@ -588,7 +692,7 @@ int cape_enable_setting( void )
 {
     uint8_t mask, b;
 
-    if ( get_enable_mask( &mask ) != 0 )
+    if ( get_enable_mask( oper_arg, &mask ) != 0 )
     {
         fprintf( stderr, "Unknown enable setting: %s.\n", oper_arg );
         return -1;
@@ -620,7 +724,7 @@ int cape_disable_setting( void )
 {
     uint8_t mask, b;
 
-    if ( get_enable_mask( &mask ) != 0 )
+    if ( get_enable_mask( oper_arg, &mask ) != 0 )
     {
         fprintf( stderr, "Unknown disable setting: %s.\n", oper_arg );
         return -1;
@@ -672,6 +776,28 @@ int cape_write_timeout( void )
 }
 
 
+// RTC calibration is held as a 9-bit pulse count with bit 15 set when
+// pulses are added, 512 to -511 in the units the options use
+uint32_t calibration_encode( int value )
+{
+    if ( value > 0 )
+    {
+        return ( 512 - value ) | 0x8000;
+    }
+    return abs( value ) & 0x1FF;
+}
+
+
+int calibration_decode( uint32_t raw )
+{
+    if ( raw & 0x8000 )
+    {
+        return 512 - ( raw & 0x1FF );
+    }
+    return 0 - ( raw & 0x1FF );
+}
+
+
 int cape_read_calibration( void )
 {
     int rc = 1;
@@ -680,14 +806,7 @@ int cape_read_calibration( void )
 
     if ( command_read32( COMMAND_GET_RTC_CAL, &value ) == 0 )
     {
-        if ( value & 0x8000 )
-        {
-            i = 512 - ( value & 0x1FF );
-        }
-        else
-        {
-            i = 0 - ( value & 0x1FF );
-        }
+        i = calibration_decode( value );
         printf( "Cape RTC calibration %04X (%d)\n", value, i );
         rc = 0;
     }
@@ -701,16 +820,8 @@ int cape_read_calibration( void )
 int cape_write_calibration( void )
 {
     int rc = 1;
-    uint32_t v;
+    uint32_t v = calibration_encode( calibration_value );
 
-    if ( calibration_value > 0 )
-    {
-        v = ( 512 - calibration_value ) | 0x8000;
-    }
-    else
-    {
-        v = abs( calibration_value ) & 0x1FF;
-    }
     printf( "Setting calibration value %d (%04X)\n", calibration_value, v );
     
     if ( command_write32( COMMAND_SET_RTC_CAL, v ) == 0 )
@@ -810,6 +921,25 @@ int cape_show_value( void )
         }
         else return 2;
     }
+    else if ( strcasecmp( oper_arg, "status" ) == 0 )
+    {
+        if ( register_read( REG_STATUS, &b ) )
+            return 2;
+
+        printf( "%d\n", b );
+    }
+    else if ( strcasecmp( oper_arg, "reason" ) == 0 )
+    {
+        if ( register_read( REG_START_REASON, &b ) )
+            return 2;
+
+        printf( "%d\n", b );
+    }
+    else
+    {
+        fprintf( stderr, "Unknown setting %s\n", oper_arg );
+        return 1;
+    }
     
     return 0;
 }
@@ -831,7 +961,9 @@ int set_external_power( void )
     {
         return command_wait( COMMAND_EXT_PWR_OFF );
     }
-    else fprintf( stderr, "Unknown argument for external power command." );
+    else fprintf( stderr, "Unknown argument for external power command.\n" );
+
+    return 1;
 }
 
 
@@ -858,65 +990,650 @@ int set_powerdown_wdt( void )
         fprintf( stderr, "Error: Power-off WDT requires argument in seconds\n" );
         rc = 1;
     }
+
+    return rc;
 }
 
 
-void boot_erase_flash( uint8_t addr )
+// Parse a config file of "setting value" lines, # starts a comment.
+// Settings left out of the file are left alone on the board.
+int config_load( const char *path, board_config_t *cfg )
 {
-    register_write( BOOT_REG_ADDR, addr );
-    msleep(1);
-    register_write( BOOT_REG_CMD, BOOT_CMD_PAGE_ERASE );
-}
+    FILE *fp;
+    char line[ 256 ];
+    char *name, *value, *end, *save;
+    int i, n = 0, rc = 0;
+    long v;
 
+    memset( cfg, 0, sizeof( *cfg ) );
 
-void boot_program_flash( uint8_t addr, uint8_t *data )
-{
-    int i;
-    
-    register_write( BOOT_REG_ADDR, addr );
-    msleep(1);
-    for ( i = 0; i < HALF_PAGE_SIZE; i += BLOCK_I2C_WRITE )
+    fp = fopen( path, "r" );
+    if ( fp == NULL )
     {
-        register_block_write( BOOT_REG_DATA, data, BLOCK_I2C_WRITE );
-        data += BLOCK_I2C_WRITE;
-        msleep(1);
+        fprintf( stderr, "Error opening %s: %s\n", path, strerror( errno ) );
+        return -1;
     }
-    register_write( BOOT_REG_CMD, BOOT_CMD_HALF_PAGE_PROG );
-}
-
 
-int boot_enter( void )
-{
-    uint8_t b = 0;
-    int rc = 0;
-    
-    register_read( REG_ID, &b );
-    if ( b != 0xBB )
+    while ( fgets( line, sizeof( line ), fp ) != NULL )
     {
-        register_read( REG_STATUS, &b );
-        if ( b & STATUS_BOOTLOADER )
+        n++;
+        if ( ( end = strchr( line, '#' ) ) != NULL ) *end = '\0';
+
+        name = strtok_r( line, " \t\r\n", &save );
+        if ( name == NULL )
+            continue;
+        value = strtok_r( NULL, " \t\r\n", &save );
+
+        for ( i = 0; i < CFG_COUNT; i++ )
         {
-            printf( "Entering bootloader...\n" );
-            
-            if ( command_wait( COMMAND_ENTER_BOOTLOADER ) == 0 )
+            if ( strcasecmp( name, config_items[ i ].name ) == 0 ) break;
+        }
+        if ( ( i == CFG_COUNT ) || ( value == NULL ) || ( strtok_r( NULL, " \t\r\n", &save ) != NULL ) )
+        {
+            fprintf( stderr, "%s line %d: expected <setting> <value>\n", path, n );
+            rc = -1;
+            continue;
+        }
+
+        // Start sources are given by name, "button,pgood", or "none"
+        if ( ( i == CFG_START ) && !isdigit( value[ 0 ] ) )
+        {
+            char *item, *isave;
+            uint8_t mask;
+
+            v = 0;
+            for ( item = strtok_r( value, ",", &isave ); item != NULL; item = strtok_r( NULL, ",", &isave ) )
             {
-                sleep( 2 );
-                
-                register_read( REG_ID, &b );
-                if ( b == 0xBB )
-                {
-                    printf( "Done.\n" );
-                }
-                else
+                if ( strcasecmp( item, "none" ) == 0 ) continue;
+                if ( get_enable_mask( item, &mask ) != 0 )
                 {
-                    printf( "Failed.\n" );
-                    rc = 1;
+                    fprintf( stderr, "%s line %d: unknown start setting %s\n", path, n, item );
+                    rc = -1;
                 }
-            }
-            else
-            {
-                fprintf( stderr, "Bootloader entry failed.\n" );
-                rc = 1;
+                v |= mask;
+            }
+        }
+        else
+        {
+            v = strtol( value, &end, 0 );
+            if ( ( *end != '\0' ) || ( v < config_items[ i ].min ) || ( v > config_items[ i ].max ) )
+            {
+                fprintf( stderr, "%s line %d: %s must be %d to %d\n", path, n, name,
+                         config_items[ i ].min, config_items[ i ].max );
+                rc = -1;
+                continue;
+            }
+        }
+
+        cfg->value[ i ] = (int)v;
+        cfg->set[ i ] = 1;
+    }
+
+    fclose( fp );
+    return rc;
+}
+
+
+// Read the board's current values for the settings in want
+int config_read( const board_config_t *want, board_config_t *cur )
+{
+    uint8_t map[ NUM_REGISTERS ];
+    uint32_t d;
+    uint8_t b;
+
+    memset( cur, 0, sizeof( *cur ) );
+
+    if ( register_snapshot( map ) != 0 )
+        return -1;
+
+    cur->value[ CFG_START ] = map[ REG_START_ENABLE ];
+    cur->value[ CFG_WDT_POWER ] = map[ REG_WDT_POWER ];
+    cur->value[ CFG_WDT_STOP ] = map[ REG_WDT_STOP ];
+    cur->value[ CFG_WDT_START ] = map[ REG_WDT_START ];
+    cur->value[ CFG_ADDRESS ] = stm_address;
+
+    if ( want->set[ CFG_RATE ] )
+    {
+        if ( command_read8( COMMAND_GET_CHARGE_RATE, &b ) != 0 )
+            return -1;
+        cur->value[ CFG_RATE ] = b;
+    }
+    if ( want->set[ CFG_RESTART ] )
+    {
+        if ( command_read32( COMMAND_GET_RESTART_TIME, &d ) != 0 )
+            return -1;
+        cur->value[ CFG_RESTART ] = d;
+    }
+    if ( want->set[ CFG_RTC_CAL ] )
+    {
+        if ( command_read32( COMMAND_GET_RTC_CAL, &d ) != 0 )
+            return -1;
+        cur->value[ CFG_RTC_CAL ] = calibration_decode( d );
+    }
+
+    return 0;
+}
+
+
+int config_write( int item, int value )
+{
+    switch ( item )
+    {
+        case CFG_START:     return register_write( REG_START_ENABLE, value );
+        case CFG_RATE:      return command_wait( COMMAND_SET_CHARGE_RATE_1 + value - 1 ) ? -1 : 0;
+        case CFG_RESTART:   return command_write32( COMMAND_SET_RESTART_TIME, value );
+        case CFG_RTC_CAL:   return command_write32( COMMAND_SET_RTC_CAL, calibration_encode( value ) );
+        case CFG_WDT_POWER: return register_write( REG_WDT_POWER, value );
+        case CFG_WDT_STOP:  return register_write( REG_WDT_STOP, value );
+        case CFG_WDT_START: return register_write( REG_WDT_START, value );
+        case CFG_ADDRESS:   return cape_set_address( value );
+    }
+    return -1;
+}
+
+
+void config_format( int item, int value, char *buf, int size )
+{
+    static const char *starts[] = { "button", "opto", "pgood", "timeout", "poweron", "wdt" };
+    int i, len = 0;
+
+    if ( item == CFG_START )
+    {
+        buf[ 0 ] = '\0';
+        for ( i = 0; i < 6; i++ )
+        {
+            if ( value & ( 1 << i ) )
+                len += snprintf( buf + len, size - len, "%s%s", len ? "," : "", starts[ i ] );
+        }
+        if ( len == 0 ) snprintf( buf, size, "none" );
+    }
+    else if ( item == CFG_ADDRESS )
+    {
+        snprintf( buf, size, "0x%02X", value );
+    }
+    else
+    {
+        snprintf( buf, size, "%d", value );
+    }
+}
+
+
+// Bring the board in line with a config file.  Only settings that differ
+// are written, the I2C address last, and the settings are stored to
+// EEPROM only when a persistent one changed.
+int cape_apply_config( void )
+{
+    board_config_t want, cur;
+    char from[ 64 ], to[ 64 ];
+    int i, changed = 0, persistent = 0, failed = 0;
+
+    if ( config_load( oper_arg, &want ) != 0 )
+        return -1;
+
+    if ( config_read( &want, &cur ) != 0 )
+    {
+        fprintf( stderr, "Error reading current settings\n" );
+        return -1;
+    }
+
+    for ( i = 0; i < CFG_COUNT; i++ )
+    {
+        if ( !want.set[ i ] )
+            continue;
+
+        config_format( i, want.value[ i ], to, sizeof( to ) );
+        if ( want.value[ i ] == cur.value[ i ] )
+        {
+            printf( "%-16s %s\n", config_items[ i ].name, to );
+            continue;
+        }
+
+        config_format( i, cur.value[ i ], from, sizeof( from ) );
+        printf( "%-16s %s -> %s\n", config_items[ i ].name, from, to );
+        changed++;
+
+        if ( dry_run )
+            continue;
+
+        if ( config_write( i, want.value[ i ] ) == 0 )
+        {
+            persistent |= config_items[ i ].persistent;
+        }
+        else
+        {
+            fprintf( stderr, "Error writing %s\n", config_items[ i ].name );
+            failed++;
+        }
+    }
+
+    if ( dry_run )
+    {
+        printf( "%d setting%s would change, nothing written\n", changed, ( changed == 1 ) ? "" : "s" );
+        return 0;
+    }
+
+    if ( persistent && !failed )
+    {
+        if ( cape_write_eeprom() != 0 )
+        {
+            fprintf( stderr, "Error storing settings to EEPROM\n" );
+            return -1;
+        }
+        printf( "%d setting%s changed, stored to EEPROM\n", changed, ( changed == 1 ) ? "" : "s" );
+    }
+    else if ( !failed )
+    {
+        printf( "%d setting%s changed, EEPROM not written\n", changed, ( changed == 1 ) ? "" : "s" );
+    }
+
+    return failed ? -1 : 0;
+}
+
+
+// Everything the daemon answers queries from, refreshed as one unit
+int board_state_read( board_state_t *st )
+{
+    if ( register_snapshot( st->regs ) != 0 )
+        return -1;
+    if ( command_read8( COMMAND_GET_CHARGE_RATE, &st->charge_rate ) != 0 )
+        return -1;
+    if ( command_read32( COMMAND_GET_RESTART_TIME, &st->restart_time ) != 0 )
+        return -1;
+    if ( command_read32( COMMAND_GET_ONTIME, &st->ontime ) != 0 )
+        return -1;
+    if ( command_read32( COMMAND_GET_OFFTIME, &st->offtime ) != 0 )
+        return -1;
+
+    st->refreshed_us = pu_monotonic_us();
+    return 0;
+}
+
+
+// Look up a -v setting in a state snapshot
+int board_state_value( const board_state_t *st, const char *name, uint32_t *value )
+{
+    if ( strcasecmp( name, "button" ) == 0 )
+        *value = ( st->regs[ REG_STATUS ] & STATUS_BUTTON ) ? 1 : 0;
+    else if ( strcasecmp( name, "pgood" ) == 0 )
+        *value = ( st->regs[ REG_STATUS ] & STATUS_POWER_GOOD ) ? 1 : 0;
+    else if ( strcasecmp( name, "rate" ) == 0 )
+        *value = st->charge_rate;
+    else if ( strcasecmp( name, "ontime" ) == 0 )
+        *value = st->ontime;
+    else if ( strcasecmp( name, "offtime" ) == 0 )
+        *value = st->offtime;
+    else if ( strcasecmp( name, "restart" ) == 0 )
+        *value = st->restart_time;
+    else if ( strcasecmp( name, "status" ) == 0 )
+        *value = st->regs[ REG_STATUS ];
+    else if ( strcasecmp( name, "reason" ) == 0 )
+        *value = st->regs[ REG_START_REASON ];
+    else
+        return -1;
+
+    return 0;
+}
+
+
+void daemon_socket_path( struct sockaddr_un *sa )
+{
+    memset( sa, 0, sizeof( *sa ) );
+    sa->sun_family = AF_UNIX;
+    snprintf( sa->sun_path, sizeof( sa->sun_path ), DAEMON_SOCKET, i2c_bus, stm_address );
+}
+
+
+int daemon_connect( void )
+{
+    struct sockaddr_un sa;
+    int fd;
+
+    daemon_socket_path( &sa );
+    fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 )
+        return -1;
+
+    if ( connect( fd, (struct sockaddr *)&sa, sizeof( sa ) ) != 0 )
+    {
+        close( fd );
+        return -1;
+    }
+
+    return fd;
+}
+
+
+// Send one request line and read back the one line reply
+int daemon_request( int fd, const char *request, char *reply, int size )
+{
+    int len = 0, n;
+
+    if ( write( fd, request, strlen( request ) ) != (int)strlen( request ) )
+        return -1;
+
+    while ( len < size - 1 )
+    {
+        n = read( fd, reply + len, size - 1 - len );
+        if ( n <= 0 )
+            return -1;
+        len += n;
+        if ( reply[ len - 1 ] == '\n' )
+            break;
+    }
+    reply[ len ] = 0;
+
+    return ( strncmp( reply, "error", 5 ) == 0 ) ? -1 : 0;
+}
+
+
+void daemon_signal( int sig )
+{
+    (void)sig;
+    daemon_running = 0;
+}
+
+
+void daemon_reply( daemon_client_t *c, const board_state_t *st, int valid, char *line )
+{
+    char reply[ 64 ];
+    uint32_t value;
+
+    if ( strncasecmp( line, "value ", 6 ) == 0 )
+    {
+        if ( !valid )
+            snprintf( reply, sizeof( reply ), "error board not responding\n" );
+        else if ( board_state_value( st, line + 6, &value ) == 0 )
+            snprintf( reply, sizeof( reply ), "%u\n", value );
+        else
+            snprintf( reply, sizeof( reply ), "error unknown setting\n" );
+    }
+    else if ( strcasecmp( line, "age" ) == 0 )
+    {
+        snprintf( reply, sizeof( reply ), "%u\n", ( pu_monotonic_us() - st->refreshed_us ) / 1000 );
+    }
+    else if ( strcasecmp( line, "hold" ) == 0 )
+    {
+        // Client talks to the board itself, stay off the bus until it's gone
+        c->hold = 1;
+        snprintf( reply, sizeof( reply ), "ok\n" );
+    }
+    else
+    {
+        snprintf( reply, sizeof( reply ), "error unknown request\n" );
+    }
+
+    // Client sockets don't block: one that isn't reading its replies is
+    // dropped rather than left to stall the refreshes and other clients
+    if ( write( c->fd, reply, strlen( reply ) ) != (int)strlen( reply ) )
+    {
+        c->len = -1;
+    }
+}
+
+
+// Own the bus: refresh the board state every daemon_refresh_ms and answer
+// queries from the cached copy over a Unix socket
+int power_daemon( void )
+{
+    struct sockaddr_un sa;
+    struct pollfd fds[ DAEMON_CLIENTS + 1 ];
+    daemon_client_t clients[ DAEMON_CLIENTS ];
+    board_state_t st;
+    struct sigaction act;
+    uint32_t next, now;
+    int listener, i, n, held, timeout, valid = 0, count = 0;
+
+    if ( ( listener = daemon_connect() ) >= 0 )
+    {
+        close( listener );
+        fprintf( stderr, "Daemon already running for bus %d address 0x%02X\n", i2c_bus, stm_address );
+        return 1;
+    }
+
+    daemon_socket_path( &sa );
+    unlink( sa.sun_path );
+    listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( ( listener < 0 ) || ( bind( listener, (struct sockaddr *)&sa, sizeof( sa ) ) != 0 ) ||
+         ( listen( listener, DAEMON_CLIENTS ) != 0 ) )
+    {
+        fprintf( stderr, "Error creating socket %s: %s\n", sa.sun_path, strerror( errno ) );
+        return 1;
+    }
+    chmod( sa.sun_path, 0666 );
+
+    memset( &act, 0, sizeof( act ) );
+    act.sa_handler = daemon_signal;
+    sigaction( SIGINT, &act, NULL );
+    sigaction( SIGTERM, &act, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    memset( &st, 0, sizeof( st ) );
+    printf( "Serving %s, refresh every %d ms\n", sa.sun_path, daemon_refresh_ms );
+    fflush( stdout );
+
+    next = pu_monotonic_us();
+    while ( daemon_running )
+    {
+        for ( held = 0, i = 0; i < count; i++ )
+        {
+            held |= clients[ i ].hold;
+        }
+
+        now = pu_monotonic_us();
+        if ( !held && ( (int)( now - next ) >= 0 ) )
+        {
+            valid = ( board_state_read( &st ) == 0 );
+            next = now + daemon_refresh_ms * 1000u;
+            now = pu_monotonic_us();
+        }
+
+        fds[ 0 ].fd = listener;
+        fds[ 0 ].events = POLLIN;
+        for ( i = 0; i < count; i++ )
+        {
+            fds[ i + 1 ].fd = clients[ i ].fd;
+            fds[ i + 1 ].events = POLLIN;
+        }
+
+        if ( held )
+            timeout = -1;
+        else if ( (int)( next - now ) > 0 )
+            timeout = (int)( next - now ) / 1000 + 1;
+        else
+            timeout = 0;
+
+        if ( poll( fds, count + 1, timeout ) < 0 )
+            continue;
+
+        for ( i = 0; i < count; i++ )
+        {
+            daemon_client_t *c = &clients[ i ];
+            char *line, *end;
+
+            if ( !( fds[ i + 1 ].revents & ( POLLIN | POLLHUP | POLLERR ) ) )
+                continue;
+
+            n = read( c->fd, c->buf + c->len, sizeof( c->buf ) - 1 - c->len );
+            if ( ( n < 0 ) && ( errno == EAGAIN ) )
+                continue;
+            if ( n <= 0 )
+            {
+                c->len = -1;
+                continue;
+            }
+            c->len += n;
+            c->buf[ c->len ] = 0;
+
+            line = c->buf;
+            while ( ( c->len >= 0 ) && ( ( end = strchr( line, '\n' ) ) != NULL ) )
+            {
+                *end = 0;
+                daemon_reply( c, &st, valid, line );
+                line = end + 1;
+            }
+            if ( c->len >= 0 )
+            {
+                c->len = strlen( line );
+                memmove( c->buf, line, c->len + 1 );
+                if ( c->len >= (int)sizeof( c->buf ) - 1 ) c->len = -1;
+            }
+        }
+
+        // Drop closed clients
+        for ( i = 0; i < count; )
+        {
+            if ( clients[ i ].len >= 0 )
+            {
+                i++;
+                continue;
+            }
+
+            // A client that held the bus may have changed the board state
+            if ( clients[ i ].hold )
+            {
+                next = pu_monotonic_us();
+            }
+            close( clients[ i ].fd );
+            clients[ i ] = clients[ --count ];
+        }
+
+        if ( fds[ 0 ].revents & POLLIN )
+        {
+            int fd = accept( listener, NULL, NULL );
+
+            if ( fd >= 0 )
+            {
+                fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+                if ( count < DAEMON_CLIENTS )
+                {
+                    clients[ count ].fd = fd;
+                    clients[ count ].len = 0;
+                    clients[ count ].hold = 0;
+                    count++;
+                }
+                else close( fd );
+            }
+        }
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        close( clients[ i ].fd );
+    }
+    close( listener );
+    unlink( sa.sun_path );
+    return 0;
+}
+
+
+// Wait for the bootloader to finish the last flash command: status holds
+// the command while busy and drops back to NOP when done
+int boot_wait( void )
+{
+    uint32_t start = pu_monotonic_us();
+    uint8_t status;
+
+    while ( 1 )
+    {
+        if ( register_read( BOOT_REG_STATUS, &status ) != 0 )
+            return -1;
+
+        if ( status == BOOT_CMD_NOP )
+            return 0;
+
+        if ( status == BOOT_CMD_ERROR )
+        {
+            fprintf( stderr, "Bootloader reported error\n" );
+            return -1;
+        }
+
+        if ( pu_monotonic_us() - start > BOOT_TIMEOUT_MS * 1000u )
+        {
+            fprintf( stderr, "Bootloader timed out (status %02X)\n", status );
+            return -1;
+        }
+
+        pu_sleep_us( BOOT_POLL_US );
+    }
+}
+
+
+int boot_erase_start( uint8_t addr )
+{
+    if ( register_write( BOOT_REG_ADDR, addr ) != 0 )
+        return -1;
+    return register_write( BOOT_REG_CMD, BOOT_CMD_PAGE_ERASE );
+}
+
+
+int boot_program_start( uint8_t addr, uint8_t *data )
+{
+    int i;
+    
+    if ( register_write( BOOT_REG_ADDR, addr ) != 0 )
+        return -1;
+    for ( i = 0; i < HALF_PAGE_SIZE; i += BLOCK_I2C_WRITE )
+    {
+        if ( register_block_write( BOOT_REG_DATA, data, BLOCK_I2C_WRITE ) != 0 )
+            return -1;
+        data += BLOCK_I2C_WRITE;
+    }
+    return register_write( BOOT_REG_CMD, BOOT_CMD_HALF_PAGE_PROG );
+}
+
+
+int boot_erase_flash( uint8_t addr )
+{
+    if ( boot_erase_start( addr ) != 0 )
+        return -1;
+    return boot_wait();
+}
+
+
+int boot_program_flash( uint8_t addr, uint8_t *data )
+{
+    if ( boot_program_start( addr, data ) != 0 )
+        return -1;
+    return boot_wait();
+}
+
+
+int boot_enter( void )
+{
+    uint8_t b = 0;
+    int rc = 0;
+    
+    if ( register_read( REG_ID, &b ) != 0 )
+    {
+        fprintf( stderr, "No board found at 0x%X\n", stm_address );
+        return 1;
+    }
+    if ( b != 0xBB )
+    {
+        if ( register_read( REG_STATUS, &b ) != 0 )
+            return 1;
+        if ( b & STATUS_BOOTLOADER )
+        {
+            printf( "Entering bootloader...\n" );
+            
+            if ( command_wait( COMMAND_ENTER_BOOTLOADER ) == 0 )
+            {
+                msleep( 2000 );
+                
+                if ( ( register_read( REG_ID, &b ) == 0 ) && ( b == 0xBB ) )
+                {
+                    printf( "Done.\n" );
+                }
+                else
+                {
+                    printf( "Failed.\n" );
+                    rc = 1;
+                }
+            }
+            else
+            {
+                fprintf( stderr, "Bootloader entry failed.\n" );
+                rc = 1;
             }
         }
         else
@@ -927,86 +1644,914 @@ int boot_enter( void )
     }
     else
     {
-        register_read( REG_PROD, &b );
-        printf( "Found bootloader level %d.\n", b );
+        if ( register_read( BOOT_REG_LEVEL, &b ) != 0 )
+            return 1;
+        printf( "Found bootloader level %d.\n", b );
+    }
+    
+    return rc;
+}
+
+
+int boot_execute( void )
+{
+    return register_write( BOOT_REG_CMD, BOOT_CMD_EXECUTE );
+}
+
+
+// FNV-1a, enough to tell whether a page's content changed
+uint64_t page_hash( const uint8_t *data, int len )
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    while ( len-- )
+    {
+        h ^= *data++;
+        h *= 0x100000001B3ULL;
+    }
+
+    return h;
+}
+
+
+// Where manifests and checkpoints live, moved with PU_STATE_DIR so test
+// runs against the simulator keep away from the real boards' state
+const char *state_dir( void )
+{
+    const char *dir = getenv( "PU_STATE_DIR" );
+
+    return ( ( dir != NULL ) && ( *dir != '\0' ) ) ? dir : MANIFEST_DIR;
+}
+
+
+// The manifest records the page hashes of the last image successfully
+// flashed to a board, keyed by the board's serial number
+void manifest_path( char *path, int size, uint32_t serial )
+{
+    snprintf( path, size, "%s/fw-%08X.manifest", state_dir(), serial );
+}
+
+
+int manifest_load( uint32_t serial, uint64_t *hashes, uint8_t *known )
+{
+    char path[ 256 ];
+    unsigned long long h;
+    FILE *fp;
+    int page, count = 0;
+
+    memset( known, 0, NUM_PAGES );
+    manifest_path( path, sizeof( path ), serial );
+
+    fp = fopen( path, "r" );
+    if ( fp == NULL )
+        return 0;
+
+    while ( fscanf( fp, "%d %llx", &page, &h ) == 2 )
+    {
+        if ( ( page >= 0 ) && ( page < NUM_PAGES ) )
+        {
+            hashes[ page ] = h;
+            known[ page ] = 1;
+            count++;
+        }
+    }
+
+    fclose( fp );
+    return count;
+}
+
+
+int manifest_save( uint32_t serial, const uint64_t *hashes, int pages )
+{
+    char path[ 256 ];
+    FILE *fp;
+    int i;
+
+    mkdir( state_dir(), 0755 );
+    manifest_path( path, sizeof( path ), serial );
+
+    fp = fopen( path, "w" );
+    if ( fp == NULL )
+    {
+        fprintf( stderr, "Unable to write manifest %s: %s\n", path, strerror( errno ) );
+        return -1;
+    }
+
+    for ( i = 0; i < pages; i++ )
+    {
+        fprintf( fp, "%d %016llx\n", i, hashes[ i ] );
+    }
+
+    fclose( fp );
+    return 0;
+}
+
+
+void manifest_remove( uint32_t serial )
+{
+    char path[ 256 ];
+
+    manifest_path( path, sizeof( path ), serial );
+    unlink( path );
+}
+
+
+// The checkpoint records how far an upload to the board at this bus and
+// address got, so an interrupted upload of the same image can be resumed
+typedef struct
+{
+    uint64_t    image;          // hash of the whole image
+    uint32_t    serial;
+    int         have_serial;
+    int         next;           // first half-page still to program, always page aligned
+} checkpoint_t;
+
+
+void checkpoint_path( char *path, int size )
+{
+    snprintf( path, size, "%s/upload-%d-%02X.checkpoint", state_dir(), i2c_bus, stm_address );
+}
+
+
+int checkpoint_load( checkpoint_t *cp )
+{
+    char path[ 256 ];
+    unsigned long long image;
+    FILE *fp;
+    int rc = -1;
+
+    checkpoint_path( path, sizeof( path ) );
+    fp = fopen( path, "r" );
+    if ( fp == NULL )
+        return -1;
+
+    if ( fscanf( fp, "%llx %x %d %d", &image, &cp->serial, &cp->have_serial, &cp->next ) == 4 )
+    {
+        cp->image = image;
+        rc = 0;
+    }
+
+    fclose( fp );
+    return rc;
+}
+
+
+// Written to a temporary file and renamed so a crash never leaves a
+// partial checkpoint behind
+int checkpoint_save( const checkpoint_t *cp )
+{
+    char path[ 256 ], tmp[ 260 ];
+    FILE *fp;
+
+    checkpoint_path( path, sizeof( path ) );
+    snprintf( tmp, sizeof( tmp ), "%s.tmp", path );
+
+    fp = fopen( tmp, "w" );
+    if ( fp == NULL )
+        return -1;
+
+    fprintf( fp, "%016llx %08X %d %d\n", cp->image, cp->serial, cp->have_serial, cp->next );
+    if ( ( fflush( fp ) != 0 ) || ( fsync( fileno( fp ) ) != 0 ) )
+    {
+        fclose( fp );
+        return -1;
+    }
+    fclose( fp );
+
+    return rename( tmp, path );
+}
+
+
+void checkpoint_remove( void )
+{
+    char path[ 256 ];
+
+    checkpoint_path( path, sizeof( path ) );
+    unlink( path );
+}
+
+
+// Erase a page and program the half-pages holding image data.  Every
+// page is programmed: the image is encoded, so nothing says which of its
+// bytes come out as erased flash.
+int boot_write_page( int page, uint8_t *data, int len )
+{
+    if ( boot_erase_flash( page * 2 ) != 0 )
+        return -1;
+
+    if ( boot_program_flash( page * 2, data ) != 0 )
+        return -1;
+
+    if ( len > HALF_PAGE_SIZE )
+    {
+        if ( boot_program_flash( page * 2 + 1, data + HALF_PAGE_SIZE ) != 0 )
+            return -1;
+    }
+
+    return 0;
+}
+
+
+// Retry a failed page from scratch, backing off to let a glitching bus settle
+int boot_write_page_retry( int page, uint8_t *data, int len )
+{
+    int attempt, delay = BOOT_RETRY_MS;
+
+    for ( attempt = 1; attempt <= BOOT_RETRIES; attempt++ )
+    {
+        if ( boot_write_page( page, data, len ) == 0 )
+            return 0;
+
+        if ( attempt < BOOT_RETRIES )
+        {
+            fprintf( stderr, "Page %d failed, retrying in %d ms\n", page, delay );
+            msleep( delay );
+            delay *= 2;
+        }
+    }
+
+    return -1;
+}
+
+
+int image_load( uint8_t **image, int *size )
+{
+    uint8_t *memblock;
+    int fsize;
+
+    filehandle = open( filename, O_RDONLY );
+    
+    if ( filehandle < 0 )
+    {
+        fprintf( stderr, "Error opening file %s\n", filename );
+        return 3;
+    }
+    
+    memblock = calloc( MAX_IMAGE_SIZE, 1 );
+    if ( !memblock )
+    {
+        fprintf( stderr, "Error allocating memory\n" );
+        close( filehandle );
+        return 3;
+    }
+    
+    fsize = read( filehandle, memblock, MAX_IMAGE_SIZE );
+    close( filehandle );
+    if ( fsize <= 0 )
+    {
+        fprintf( stderr, "Error reading file %s\n", filename );
+        free( memblock );
+        return 3;
+    }
+    printf( "%d bytes read\n", fsize );
+    
+    if ( *(uint32_t*)memblock == 0x200007FF )
+    {
+        fprintf( stderr, "Error: image not encoded\n" );
+        free( memblock );
+        return 2;
+    }
+
+    *image = memblock;
+    *size = fsize;
+    return 0;
+}
+
+
+int boot_upload( void )
+{
+    int fsize;
+    uint8_t *memblock;
+    uint8_t *ptr;
+    uint8_t b = 0;
+    uint64_t hashes[ NUM_PAGES ], old[ NUM_PAGES ];
+    uint8_t known[ NUM_PAGES ];
+    checkpoint_t cp;
+    uint32_t start, t;
+    uint32_t page_min = 0xFFFFFFFF, page_max = 0;
+    int page, pages, len;
+    int written = 0, unchanged = 0, bytes = 0;
+    int first = 0;
+    int rc = 0;
+    
+    // Load the image before touching the board so a bad file can't leave
+    // it sitting in the bootloader
+    rc = image_load( &memblock, &fsize );
+    if ( rc != 0 )
+        return rc;
+
+    memset( &cp, 0, sizeof( cp ) );
+    cp.image = page_hash( memblock, fsize );
+
+    if ( resume_upload )
+    {
+        checkpoint_t saved;
+
+        if ( ( checkpoint_load( &saved ) == 0 ) && ( saved.image == cp.image ) )
+        {
+            cp = saved;
+            first = cp.next;
+            printf( "Resuming at half-page %d\n", first );
+        }
+        else
+        {
+            printf( "No checkpoint for this image, starting from the beginning\n" );
+        }
+    }
+
+    // The serial is only available from the application firmware
+    if ( ( first == 0 ) && ( register_read( REG_ID, &b ) == 0 ) && ( b == 0xED ) &&
+         ( command_read32( COMMAND_GET_SERIAL, &cp.serial ) == 0 ) )
+    {
+        cp.have_serial = 1;
+    }
+
+    if ( boot_enter() != 0 )
+    {
+        free( memblock );
+        return 1;
+    }
+    
+    pages = ( fsize + FLASH_PAGE_SIZE - 1 ) / FLASH_PAGE_SIZE;
+    for ( page = 0; page < pages; page++ )
+    {
+        hashes[ page ] = page_hash( (uint8_t *)memblock + page * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE );
+    }
+
+    memset( known, 0, sizeof( known ) );
+    if ( cp.have_serial )
+    {
+        if ( !full_upload && ( first == 0 ) && ( manifest_load( cp.serial, old, known ) > 0 ) )
+        {
+            printf( "Using manifest for board %08X\n", cp.serial );
+        }
+        // Flash no longer matches the manifest once any page is touched
+        manifest_remove( cp.serial );
+    }
+
+    mkdir( state_dir(), 0755 );
+    cp.next = first;
+    if ( checkpoint_save( &cp ) != 0 )
+    {
+        fprintf( stderr, "Warning: unable to save checkpoint, upload can't be resumed\n" );
+    }
+
+    start = pu_monotonic_us();
+    for ( page = first / 2; page < pages; page++ )
+    {
+        ptr = (uint8_t *)memblock + page * FLASH_PAGE_SIZE;
+        len = fsize - page * FLASH_PAGE_SIZE;
+        if ( len > FLASH_PAGE_SIZE ) len = FLASH_PAGE_SIZE;
+
+        if ( known[ page ] && ( old[ page ] == hashes[ page ] ) )
+        {
+            unchanged++;
+            continue;
+        }
+
+        t = pu_monotonic_us();
+        if ( boot_write_page_retry( page, ptr, len ) != 0 )
+            break;
+        t = pu_monotonic_us() - t;
+
+        cp.next = ( page + 1 ) * 2;
+        checkpoint_save( &cp );
+
+        if ( t < page_min ) page_min = t;
+        if ( t > page_max ) page_max = t;
+        written++;
+        bytes += len;
+        
+        printf( "Page %3d: %5u us\r", page, t );
+        fflush( stdout );
+    }
+    printf( "\n" );
+    
+    if ( page < pages )
+    {
+        fprintf( stderr, "Upload failed at page %d, use --resume to continue\n", page );
+        rc = 4;
+    }
+    else
+    {
+        t = pu_monotonic_us() - start;
+        printf( "%d bytes programmed in %.2f s (%.0f bytes/s)\n", bytes, t / 1e6, bytes * 1e6 / ( t ? t : 1 ) );
+        printf( "%d pages written", written );
+        if ( written ) printf( " (%u-%u us each)", page_min, page_max );
+        printf( ", %d unchanged\n", unchanged );
+
+        checkpoint_remove();
+        if ( cp.have_serial )
+        {
+            manifest_save( cp.serial, hashes, pages );
+        }
+        if ( boot_execute() != 0 )
+        {
+            fprintf( stderr, "Error starting firmware\n" );
+            rc = 4;
+        }
     }
     
+    free( memblock );
     return rc;
 }
 
 
-void boot_execute( void )
+// Fleet upload: one thread per bus, each driving all of its boards at once.
+// Flash commands are issued to every board in turn and their completion
+// polled, so one board's erase or program time overlaps the data transfer
+// to the next.
+void fleet_finish( fleet_target_t *t )
 {
-    register_write( BOOT_REG_CMD, BOOT_CMD_EXECUTE );
+    if ( boot_execute() != 0 )
+    {
+        t->state = FLEET_FAILED;
+        return;
+    }
+    if ( t->have_serial )
+    {
+        manifest_save( t->serial, fleet_hashes, fleet_pages );
+    }
+    t->state = FLEET_DONE;
 }
 
 
-int boot_upload( void )
+// Move on to the next page that needs writing
+void fleet_next_page( fleet_target_t *t )
 {
-    int fsize, count;
-    void *memblock;
-    uint8_t *ptr;
-    uint8_t halfpage = 0;
-    int rc = 0;
-    
-    if ( boot_enter() != 0 )
+    t->page++;
+    t->attempt = 0;
+    while ( ( t->page < fleet_pages ) && t->known[ t->page ] && ( t->old[ t->page ] == fleet_hashes[ t->page ] ) )
     {
-        return 1;
+        t->unchanged++;
+        t->page++;
     }
-    
-    filehandle = open( filename, O_RDONLY );
-    
-    if ( filehandle < 0 )
+
+    t->state = FLEET_ERASE;
+    if ( t->page >= fleet_pages )
     {
-        fprintf( stderr, "Error opening file %s\n", filename );
-        return 3;
+        fleet_finish( t );
     }
-    
-    memblock = calloc( MAX_IMAGE_SIZE, 1 );
-    if ( !memblock )
+    t->elapsed_us = pu_monotonic_us() - t->start_us;
+}
+
+
+// Start the page over after a backoff, or give up on the board
+void fleet_retry( fleet_target_t *t )
+{
+    pthread_mutex_lock( &fleet_lock );
+    t->retries++;
+    if ( ++t->attempt >= BOOT_RETRIES )
     {
-        fprintf( stderr, "Error allocating memory\n" );
-        return 3;
+        t->state = FLEET_FAILED;
     }
-    
-    fsize = read( filehandle, memblock, MAX_IMAGE_SIZE );
-    close( filehandle );
-    printf( "%d bytes read\n", fsize );
-    
-    if ( *(uint32_t*)memblock != 0x200007FF )
+    else
+    {
+        t->resume_us = pu_monotonic_us() + ( BOOT_RETRY_MS * 1000u << ( t->attempt - 1 ) );
+        t->state = FLEET_ERASE;
+    }
+    pthread_mutex_unlock( &fleet_lock );
+}
+
+
+// The last flash command completed, work out the next one
+void fleet_advance( fleet_target_t *t )
+{
+    uint8_t *data = fleet_image + t->page * FLASH_PAGE_SIZE;
+    int len = fleet_image_size - t->page * FLASH_PAGE_SIZE;
+
+    if ( len > FLASH_PAGE_SIZE ) len = FLASH_PAGE_SIZE;
+
+    pthread_mutex_lock( &fleet_lock );
+    switch ( t->state )
     {
-        ptr = memblock;
-        while ( fsize > 0 )
+        case FLEET_ERASE:
         {
-            boot_erase_flash( halfpage );
-            msleep( I2C_DELAY_MS );
-            
-            boot_program_flash( halfpage, ptr );
-            msleep( I2C_DELAY_MS );
-            
-            halfpage++;
-            ptr += HALF_PAGE_SIZE;
-            fsize -= HALF_PAGE_SIZE;
-            if ( fsize < 0 ) break;
-            
-            boot_program_flash( halfpage, ptr );
-            msleep( I2C_DELAY_MS );
-            
-            halfpage++;
-            ptr += HALF_PAGE_SIZE;
-            fsize -= HALF_PAGE_SIZE;
+            t->state = FLEET_PROG_LO;
+            break;
+        }
+
+        case FLEET_PROG_LO:
+        {
+            if ( len > HALF_PAGE_SIZE )
+            {
+                t->state = FLEET_PROG_HI;
+                break;
+            }
+            t->written++;
+            fleet_next_page( t );
+            break;
+        }
+
+        case FLEET_PROG_HI:
+        {
+            t->written++;
+            fleet_next_page( t );
+            break;
+        }
+
+        default:
+        {
+            break;
         }
-        
-        boot_execute();
     }
-    else
+    pthread_mutex_unlock( &fleet_lock );
+}
+
+
+// Poll or issue one flash command for a board, returns 1 if a command
+// was issued or completed
+int fleet_step( fleet_target_t *t )
+{
+    uint32_t now = pu_monotonic_us();
+    uint8_t *data = fleet_image + t->page * FLASH_PAGE_SIZE;
+    uint8_t status;
+    int rc = -1;
+
+    if ( t->busy )
     {
-        fprintf( stderr, "Error: image not encoded\n" );
-        rc = 2;
+        if ( register_read( BOOT_REG_STATUS, &status ) != 0 )
+        {
+            status = BOOT_CMD_ERROR;
+        }
+
+        if ( status == BOOT_CMD_NOP )
+        {
+            t->busy = 0;
+            fleet_advance( t );
+            return 1;
+        }
+
+        if ( ( status == BOOT_CMD_ERROR ) || ( now - t->issued_us > BOOT_TIMEOUT_MS * 1000u ) )
+        {
+            t->busy = 0;
+            fleet_retry( t );
+        }
+        return 0;
     }
-    
-    free( memblock );
-    return rc;
+
+    if ( (int)( now - t->resume_us ) < 0 )
+        return 0;
+
+    switch ( t->state )
+    {
+        case FLEET_ERASE:   rc = boot_erase_start( t->page * 2 ); break;
+        case FLEET_PROG_LO: rc = boot_program_start( t->page * 2, data ); break;
+        case FLEET_PROG_HI: rc = boot_program_start( t->page * 2 + 1, data + HALF_PAGE_SIZE ); break;
+        default:            break;
+    }
+
+    if ( rc != 0 )
+    {
+        fleet_retry( t );
+        return 0;
+    }
+
+    t->busy = 1;
+    t->issued_us = now;
+    return 1;
+}
+
+
+void fleet_select( fleet_target_t *t )
+{
+    board = &t->dev;
+}
+
+
+// Read the serial and manifest while the application still runs, then
+// ask it to enter the bootloader.  Returns 1 if the board is rebooting
+// into the bootloader, 0 if it is already there.
+int fleet_prepare( fleet_target_t *t )
+{
+    uint8_t b;
+
+    fleet_select( t );
+    if ( register_read( REG_ID, &b ) != 0 )
+        return -1;
+
+    if ( b == 0xBB )
+        return 0;
+
+    if ( b != 0xED )
+        return -1;
+
+    if ( command_read32( COMMAND_GET_SERIAL, &t->serial ) == 0 )
+    {
+        t->have_serial = 1;
+        if ( !full_upload )
+        {
+            manifest_load( t->serial, t->old, t->known );
+        }
+        manifest_remove( t->serial );
+    }
+
+    if ( ( register_read( REG_STATUS, &b ) != 0 ) || !( b & STATUS_BOOTLOADER ) )
+        return -1;
+
+    return ( command_wait( COMMAND_ENTER_BOOTLOADER ) == 0 ) ? 1 : -1;
+}
+
+
+void *fleet_worker( void *arg )
+{
+    int bus = (int)(long)arg;
+    int i, rc, active, issued, entering = 0;
+    fleet_target_t *t;
+
+    for ( i = 0; i < fleet_count; i++ )
+    {
+        t = &fleet[ i ];
+        if ( t->bus != bus )
+            continue;
+
+        rc = ( board_open( &t->dev, bus, t->address ) == 0 ) ? fleet_prepare( t ) : -1;
+        if ( rc < 0 )
+        {
+            pthread_mutex_lock( &fleet_lock );
+            t->state = FLEET_FAILED;
+            pthread_mutex_unlock( &fleet_lock );
+        }
+        else if ( rc > 0 )
+        {
+            entering = 1;
+        }
+    }
+
+    // Boards reboot into the bootloader together
+    if ( entering )
+    {
+        msleep( 2000 );
+    }
+
+    for ( i = 0; i < fleet_count; i++ )
+    {
+        uint8_t b = 0;
+
+        t = &fleet[ i ];
+        if ( ( t->bus != bus ) || ( t->state == FLEET_FAILED ) )
+            continue;
+
+        pthread_mutex_lock( &fleet_lock );
+        fleet_select( t );
+        if ( ( register_read( BOOT_REG_ID, &b ) != 0 ) || ( b != 0xBB ) )
+        {
+            t->state = FLEET_FAILED;
+        }
+        else
+        {
+            t->start_us = pu_monotonic_us();
+            t->resume_us = t->start_us;
+            t->page = -1;
+            fleet_next_page( t );
+        }
+        pthread_mutex_unlock( &fleet_lock );
+    }
+
+    do
+    {
+        active = issued = 0;
+        for ( i = 0; i < fleet_count; i++ )
+        {
+            t = &fleet[ i ];
+            if ( ( t->bus != bus ) || ( t->state == FLEET_DONE ) || ( t->state == FLEET_FAILED ) )
+                continue;
+
+            active++;
+            fleet_select( t );
+            issued += fleet_step( t );
+        }
+
+        if ( active && !issued )
+        {
+            pu_sleep_us( BOOT_POLL_US );
+        }
+    } while ( active );
+
+    for ( i = 0; i < fleet_count; i++ )
+    {
+        if ( fleet[ i ].bus == bus ) pu_close( &fleet[ i ].dev );
+    }
+    return NULL;
+}
+
+
+int fleet_show( int redraw )
+{
+    static const char *states[] = { "waiting", "erasing", "programming", "programming", "done", "FAILED" };
+    int i, finished = 0;
+
+    if ( redraw )
+    {
+        printf( "\033[%dA", fleet_count + 1 );
+    }
+
+    printf( "Bus Addr Serial    Page     Written Same Retry   Time  State\n" );
+    pthread_mutex_lock( &fleet_lock );
+    for ( i = 0; i < fleet_count; i++ )
+    {
+        fleet_target_t *t = &fleet[ i ];
+        int page = ( t->page < 0 ) ? 0 : ( t->page > fleet_pages ) ? fleet_pages : t->page;
+
+        if ( t->have_serial ) printf( "%3d 0x%02X %08X ", t->bus, t->address, t->serial );
+        else printf( "%3d 0x%02X %-8s ", t->bus, t->address, "-" );
+        printf( "%3d/%-3d %7d %4d %5d %5.1fs  %-12s\n", page, fleet_pages, t->written, t->unchanged,
+                t->retries, t->elapsed_us / 1e6, states[ t->state ] );
+
+        if ( ( t->state == FLEET_DONE ) || ( t->state == FLEET_FAILED ) )
+            finished++;
+    }
+    pthread_mutex_unlock( &fleet_lock );
+    fflush( stdout );
+
+    return ( finished == fleet_count );
+}
+
+
+int fleet_upload( void )
+{
+    pthread_t threads[ FLEET_MAX ];
+    int buses[ FLEET_MAX ];
+    int i, j, nbus = 0, failed = 0, done = 0, shown = 0;
+    int tty = isatty( STDOUT_FILENO );
+    uint32_t start;
+    int rc;
+
+    rc = image_load( &fleet_image, &fleet_image_size );
+    if ( rc != 0 )
+        return rc;
+
+    fleet_pages = ( fleet_image_size + FLASH_PAGE_SIZE - 1 ) / FLASH_PAGE_SIZE;
+    for ( i = 0; i < fleet_pages; i++ )
+    {
+        fleet_hashes[ i ] = page_hash( fleet_image + i * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE );
+    }
+    mkdir( state_dir(), 0755 );
+
+    start = pu_monotonic_us();
+    for ( i = 0; i < fleet_count; i++ )
+    {
+        for ( j = 0; j < nbus; j++ )
+        {
+            if ( buses[ j ] == fleet[ i ].bus ) break;
+        }
+        if ( j < nbus )
+            continue;
+
+        buses[ nbus ] = fleet[ i ].bus;
+        if ( pthread_create( &threads[ nbus ], NULL, fleet_worker, (void *)(long)fleet[ i ].bus ) != 0 )
+        {
+            fprintf( stderr, "Error starting worker for bus %d\n", fleet[ i ].bus );
+            for ( j = 0; j < fleet_count; j++ )
+            {
+                if ( fleet[ j ].bus == buses[ nbus ] ) fleet[ j ].state = FLEET_FAILED;
+            }
+            continue;
+        }
+        nbus++;
+    }
+
+    // Progress is redrawn in place on a terminal, otherwise shown once at the end
+    while ( !done )
+    {
+        if ( tty )
+        {
+            done = fleet_show( shown++ );
+        }
+        else
+        {
+            pthread_mutex_lock( &fleet_lock );
+            for ( done = 1, j = 0; j < fleet_count; j++ )
+            {
+                if ( ( fleet[ j ].state != FLEET_DONE ) && ( fleet[ j ].state != FLEET_FAILED ) ) done = 0;
+            }
+            pthread_mutex_unlock( &fleet_lock );
+        }
+        if ( !done ) msleep( FLEET_REFRESH_MS );
+    }
+
+    for ( j = 0; j < nbus; j++ )
+    {
+        pthread_join( threads[ j ], NULL );
+    }
+
+    if ( !tty )
+    {
+        fleet_show( 0 );
+    }
+
+    for ( i = 0; i < fleet_count; i++ )
+    {
+        if ( fleet[ i ].state != FLEET_DONE ) failed++;
+    }
+    printf( "%d boards on %d buses in %.2f s, %d failed\n", fleet_count, nbus, ( pu_monotonic_us() - start ) / 1e6, failed );
+
+    free( fleet_image );
+    return failed ? 4 : 0;
+}
+
+
+const char *command_name( uint8_t command )
+{
+    switch ( command )
+    {
+        case COMMAND_CHARGE_ENABLE:         return "CHARGE_ENABLE";
+        case COMMAND_CHARGE_DISABLE:        return "CHARGE_DISABLE";
+        case COMMAND_LED_ON_MS:             return "LED_ON_MS";
+        case COMMAND_LED_OFF_MS:            return "LED_OFF_MS";
+        case COMMAND_EXT_PWR_ON:            return "EXT_PWR_ON";
+        case COMMAND_EXT_PWR_OFF:           return "EXT_PWR_OFF";
+        case COMMAND_SET_RESTART_TIME:      return "SET_RESTART_TIME";
+        case COMMAND_GET_RESTART_TIME:      return "GET_RESTART_TIME";
+        case COMMAND_CLEAR_RESTART_TIME:    return "CLEAR_RESTART_TIME";
+        case COMMAND_GET_ONTIME:            return "GET_ONTIME";
+        case COMMAND_GET_OFFTIME:           return "GET_OFFTIME";
+        case COMMAND_GET_CHARGE_RATE:       return "GET_CHARGE_RATE";
+        case COMMAND_SET_CHARGE_RATE_1:     return "SET_CHARGE_RATE_1";
+        case COMMAND_SET_CHARGE_RATE_2:     return "SET_CHARGE_RATE_2";
+        case COMMAND_SET_CHARGE_RATE_3:     return "SET_CHARGE_RATE_3";
+        case COMMAND_FIRMWARE_TIMESTAMP:    return "FIRMWARE_TIMESTAMP";
+        case COMMAND_READ_COUNT:            return "READ_COUNT";
+        case COMMAND_WRITE_COUNT:           return "WRITE_COUNT";
+        case COMMAND_SET_I2C_ADDRESS:       return "SET_I2C_ADDRESS";
+        case COMMAND_SET_RTC_ADDRESS:       return "SET_RTC_ADDRESS";
+        case COMMAND_DISARM_VCC:            return "DISARM_VCC";
+        case COMMAND_ARM_VCC:               return "ARM_VCC";
+        case COMMAND_LOADER_TIMESTAMP:      return "LOADER_TIMESTAMP";
+        case COMMAND_GET_RTC_CAL:           return "GET_RTC_CAL";
+        case COMMAND_SET_RTC_CAL:           return "SET_RTC_CAL";
+        case COMMAND_GET_TIMESTAMP:         return "GET_TIMESTAMP";
+        case COMMAND_GET_SERIAL:            return "GET_SERIAL";
+        case COMMAND_EEPROM_CLEAR:          return "EEPROM_CLEAR";
+        case COMMAND_EEPROM_STORE:          return "EEPROM_STORE";
+        case COMMAND_REBOOT:                return "REBOOT";
+        case COMMAND_ENTER_BOOTLOADER:      return "ENTER_BOOTLOADER";
+        default:                            return "unknown";
+    }
+}
+
+
+void show_command_stats( void )
+{
+    int c, b;
+
+    fprintf( stderr, "\nCommand              Count    Min    Avg    Max (us)\n" );
+    for ( c = 0; c < 256; c++ )
+    {
+        cmd_stats_t *st = &cmd_stats[ c ];
+
+        if ( st->count == 0 )
+            continue;
+
+        fprintf( stderr, "%02X %-18s %5u %6u %6u %6u\n", c, command_name( c ), st->count,
+                 st->min_us, st->total_us / st->count, st->max_us );
+        for ( b = 0; b < CMD_HIST_BUCKETS; b++ )
+        {
+            if ( st->hist[ b ] == 0 )
+                continue;
+            if ( b < CMD_HIST_BUCKETS - 1 )
+                fprintf( stderr, "      < %6u us   %5u\n", 64u << b, st->hist[ b ] );
+            else
+                fprintf( stderr, "      >=%6u us   %5u\n", 64u << ( b - 1 ), st->hist[ b ] );
+        }
+    }
+}
+
+
+void batch_add( void )
+{
+    batch_op_t *b;
+
+    if ( batch_count >= BATCH_MAX )
+    {
+        fprintf( stderr, "At most %d operations can be run together\n", BATCH_MAX );
+        parse_failed = 1;
+        return;
+    }
+
+    b = &batch[ batch_count++ ];
+    b->operation = operation;
+    b->oper_arg = oper_arg;
+    b->filename = filename;
+    b->charge_rate = charge_rate;
+    b->power_timeout = power_timeout;
+    b->calibration_value = calibration_value;
+    b->new_address = new_address;
+}
+
+
+// Put a queued step's settings back where the operations expect them
+void batch_select( int i )
+{
+    batch_op_t *b = &batch[ i ];
+
+    operation = b->operation;
+    oper_arg = b->oper_arg;
+    filename = b->filename;
+    charge_rate = b->charge_rate;
+    power_timeout = b->power_timeout;
+    calibration_value = b->calibration_value;
+    new_address = b->new_address;
 }
 
 
@@ -1021,6 +2566,7 @@ void show_usage( char *progname )
     fprintf( stderr, "      -B --battery <1-3>      Set battery charge rate in thirds of an amp\n" );
     fprintf( stderr, "      -C                      Charger enable\n" );
     fprintf( stderr, "      -c                      Charger disable (power will be lost if no battery!)\n" );
+    fprintf( stderr, "      -D --daemon             Own the bus and serve cached state to other invocations\n" );
     fprintf( stderr, "      -d --disable <setting>  Disable power-up setting:\n" );
     fprintf( stderr, "                  button          Button pressed\n" );
     fprintf( stderr, "                  opto            External opto signal\n" );
@@ -1029,14 +2575,23 @@ void show_usage( char *progname )
     fprintf( stderr, "                  poweron         Initial power\n" );
     fprintf( stderr, "                  auto-off        Auto power-off by VCC (cape) or GPIO26 (HAT)\n" );
     fprintf( stderr, "      -e --enable  <setting>  Enable power-up setting (same as above)\n" );
+    fprintf( stderr, "      -f --file <script>      Also run the operations in <script>, one per line (- for stdin)\n" );
+    fprintf( stderr, "      -F --full               Upload every page, ignoring the board's manifest\n" );
+    fprintf( stderr, "      -i --interval <ms>      Daemon refresh interval (default %d ms)\n", DAEMON_REFRESH_MS );
     fprintf( stderr, "      -k --killpower          Set power-off WDT timer (0-255 seconds)\n" );
+    fprintf( stderr, "      -K --keep-going         Carry on with later operations after one fails\n" );
+    fprintf( stderr, "      -l --legacy             Use separate write/read transfers, no block reads\n" );
+    fprintf( stderr, "      -n --dry-run            Show what --apply would change without writing\n" );
     fprintf( stderr, "      -p --power              External power off/on (0-1)\n" );
     fprintf( stderr, "                              On the HAT/Cape, this is the external LED connector\n" );
     fprintf( stderr, "      -q --query              Query board info\n" );
     fprintf( stderr, "      -r --read               Read and display board RTC value\n" );
     fprintf( stderr, "      -R --set                Set system time from RTC\n" );
     fprintf( stderr, "      -s --store              Store current settings in EEPROM\n" );
+    fprintf( stderr, "      -S --stats              Show command latency statistics on exit\n" );
     fprintf( stderr, "      -t --timeout            Set power-on timeout value\n" );
+    fprintf( stderr, "      -T --targets <list>     Upload to several boards, list of bus:addr,...\n" );
+    fprintf( stderr, "      -U --resume             Resume an interrupted firmware upload\n" );
     fprintf( stderr, "      -v --value <setting>    Return numeric value (for scripts) of:\n" );
     fprintf( stderr, "                  button          Button pressed (0-1)\n" );
     fprintf( stderr, "                  pgood           DC power good (0-1)\n" );
@@ -1044,16 +2599,61 @@ void show_usage( char *progname )
     fprintf( stderr, "                  ontime          Powered duration (seconds)\n" );
     fprintf( stderr, "                  offtime         Last power off duration (seconds)\n" );
     fprintf( stderr, "                  restart         Power-up restart timer (seconds)\n" );
+    fprintf( stderr, "                  status          Status register (bits)\n" );
+    fprintf( stderr, "                  reason          Power-on reason register (bits)\n" );
     fprintf( stderr, "      -w --write              Write RTC from system time\n" );
+    fprintf( stderr, "      -W --wait <ms>          Command completion timeout (default %d ms)\n", CMD_TIMEOUT_MS );
     fprintf( stderr, "      -X --calibrate          Set RTC calibration value\n" );
     fprintf( stderr, "      -x                      Read RTC calibration value\n" );
+    fprintf( stderr, "      -y --apply <file>       Bring settings in line with a config file\n" );
     fprintf( stderr, "      -z --reset              Restart power controller\n" );
     fprintf( stderr, "      -Z --upload <file>      Upload firmware image\n" );
     fprintf( stderr, "\n" );
+    fprintf( stderr, "   Several operations may be given, they run in order on the one board.\n" );
+    fprintf( stderr, "\n" );
     exit( 1 );
 }
 
 
+// Parse "bus:addr,bus:addr,..."
+int parse_targets( char *list )
+{
+    char *p = list;
+
+    while ( *p )
+    {
+        fleet_target_t *t;
+        long bus, addr;
+        char *end;
+
+        if ( fleet_count >= FLEET_MAX )
+            return -1;
+
+        bus = strtol( p, &end, 0 );
+        if ( ( end == p ) || ( *end != ':' ) || ( bus < 0 ) )
+            return -1;
+        p = end + 1;
+
+        addr = strtol( p, &end, 0 );
+        if ( ( end == p ) || ( addr < 0x08 ) || ( addr > 0x77 ) )
+            return -1;
+        p = end;
+
+        t = &fleet[ fleet_count++ ];
+        memset( t, 0, sizeof( *t ) );
+        t->bus = bus;
+        t->address = addr;
+
+        if ( *p == ',' )
+            p++;
+        else if ( *p )
+            return -1;
+    }
+
+    return ( fleet_count > 0 ) ? 0 : -1;
+}
+
+
 void parse( int argc, char *argv[] )
 {
     while ( 1 )
@@ -1065,17 +2665,29 @@ void parse( int argc, char *argv[] )
             { "i2c",        1,  NULL,   'A'   },
             { "bus",        1,  NULL,   'b'   },
             { "battery",    1,  NULL,   'B'   },
+            { "daemon",     0,  NULL,   'D'   },
             { "disable",    1,  NULL,   'd'   },
             { "enable",     1,  NULL,   'e'   },
+            { "file",       1,  NULL,   'f'   },
+            { "full",       0,  NULL,   'F'   },
+            { "interval",   1,  NULL,   'i'   },
             { "killpower",  1,  NULL,   'k'   },
+            { "keep-going", 0,  NULL,   'K'   },
+            { "legacy",     0,  NULL,   'l'   },
+            { "dry-run",    0,  NULL,   'n'   },
             { "power",      1,  NULL,   'p'   },
             { "query",      0,  NULL,   'q'   },
             { "store",      0,  NULL,   's'   },
+            { "stats",      0,  NULL,   'S'   },
             { "timeout",    1,  NULL,   't'   },
+            { "targets",    1,  NULL,   'T'   },
+            { "resume",     0,  NULL,   'U'   },
             { "read",       0,  NULL,   'r'   },
             { "set",        0,  NULL,   's'   },
             { "value",      1,  NULL,   'v'   },
             { "write",      0,  NULL,   'w'   },
+            { "apply",      1,  NULL,   'y'   },
+            { "wait",       1,  NULL,   'W'   },
             { "calibrate",  1,  NULL,   'X'   },
             { "reset",      0,  NULL,   'z'   },
             { "upload",     1,  NULL,   'Z'   },
@@ -1083,7 +2695,7 @@ void parse( int argc, char *argv[] )
         };
         int c;
 
-        c = getopt_long( argc, argv, "?a:A:b:B:cCd:e:h:k:p:qrRst:v:wxX:zZ:", lopts, NULL );
+        c = getopt_long( argc, argv, "?a:A:b:B:cCd:De:f:Fh:i:k:Klnp:qrRsSt:T:Uv:wW:xX:y:zZ:", lopts, NULL );
 
         if ( c == -1 )
             break;
@@ -1119,6 +2731,7 @@ void parse( int argc, char *argv[] )
                 else
                 {
                     fprintf( stderr, "Invalid I2C address\n" );
+                    parse_failed = 1;
                 }
                 break;
             }
@@ -1149,7 +2762,7 @@ void parse( int argc, char *argv[] )
                 else
                 {
                     fprintf( stderr, "Invalid charge rate\n" );
-                    operation = OP_NONE;
+                    parse_failed = 1;
                 }
                 break;
             }
@@ -1176,11 +2789,17 @@ void parse( int argc, char *argv[] )
                 else
                 {
                     fprintf( stderr, "Missing setting for disable\n" );
-                    operation = OP_NONE;
+                    parse_failed = 1;
                 }
                 break;
             }
             
+            case 'D':
+            {
+                operation = OP_DAEMON;
+                break;
+            }
+
             case 'e':
             {
                 if ( optarg != NULL )
@@ -1191,7 +2810,44 @@ void parse( int argc, char *argv[] )
                 else
                 {
                     fprintf( stderr, "Missing setting for enable\n" );
-                    operation = OP_NONE;
+                    parse_failed = 1;
+                }
+                break;
+            }
+
+            case 'f':
+            {
+                if ( script_line )
+                {
+                    fprintf( stderr, "Scripts can't include other scripts\n" );
+                    parse_failed = 1;
+                }
+                else
+                {
+                    script_name = optarg;
+                }
+                break;
+            }
+
+            case 'F':
+            {
+                full_upload = 1;
+                break;
+            }
+
+            case 'i':
+            {
+                int i;
+                
+                i = atoi( optarg );
+                if ( i > 0 )
+                {
+                    daemon_refresh_ms = i;
+                }
+                else
+                {
+                    fprintf( stderr, "Invalid refresh interval\n" );
+                    parse_failed = 1;
                 }
                 break;
             }
@@ -1206,11 +2862,29 @@ void parse( int argc, char *argv[] )
                 else
                 {
                     fprintf( stderr, "Missing setting for power-down watchdog\n" );
-                    operation = OP_NONE;
+                    parse_failed = 1;
                 }
                 break;
 			}
 
+            case 'K':
+            {
+                keep_going = 1;
+                break;
+            }
+
+            case 'l':
+            {
+                pu_set_legacy( 1 );
+                break;
+            }
+
+            case 'n':
+            {
+                dry_run = 1;
+                break;
+            }
+
             case 'p':
             {
                 if ( optarg != NULL )
@@ -1221,7 +2895,7 @@ void parse( int argc, char *argv[] )
                 else
                 {
                     fprintf( stderr, "Missing setting for enable\n" );
-                    operation = OP_NONE;
+                    parse_failed = 1;
                 }
                 break;
             }
@@ -1238,6 +2912,12 @@ void parse( int argc, char *argv[] )
                 break;
             }
             
+            case 'S':
+            {
+                show_stats = 1;
+                break;
+            }
+            
             case 't':
             {
                 power_timeout = atoi( optarg );
@@ -1257,6 +2937,23 @@ void parse( int argc, char *argv[] )
                 break;
             }
 
+            case 'T':
+            {
+                if ( parse_targets( optarg ) != 0 )
+                {
+                    fprintf( stderr, "Invalid target list\n" );
+                    operation = OP_NONE;
+                    show_usage( argv[ 0 ] );
+                }
+                break;
+            }
+
+            case 'U':
+            {
+                resume_upload = 1;
+                break;
+            }
+
             case 'v':
             {
                 if ( optarg != NULL )
@@ -1267,7 +2964,7 @@ void parse( int argc, char *argv[] )
                 else
                 {
                     fprintf( stderr, "Missing setting for disable\n" );
-                    operation = OP_NONE;
+                    parse_failed = 1;
                 }
                 break;
             }
@@ -1278,6 +2975,23 @@ void parse( int argc, char *argv[] )
                 break;
             }
 
+            case 'W':
+            {
+                int i;
+                
+                i = atoi( optarg );
+                if ( i > 0 )
+                {
+                    command_timeout_ms = i;
+                }
+                else
+                {
+                    fprintf( stderr, "Invalid command timeout\n" );
+                    parse_failed = 1;
+                }
+                break;
+            }
+
             case 'x':
             {
                 operation = OP_READ_CAL;
@@ -1295,7 +3009,24 @@ void parse( int argc, char *argv[] )
                 else
                 {
                     fprintf( stderr, "Invalid calibration value\n" );
-                    operation = OP_NONE;
+                    parse_failed = 1;
+                }
+                break;
+            }
+
+            case 'y':
+            {
+                board_config_t cfg;
+
+                // Check the file now so a bad one stops the whole batch
+                if ( config_load( optarg, &cfg ) == 0 )
+                {
+                    oper_arg = optarg;
+                    operation = OP_APPLY;
+                }
+                else
+                {
+                    parse_failed = 1;
                 }
                 break;
             }
@@ -1316,59 +3047,103 @@ void parse( int argc, char *argv[] )
             case '?':
             {
                 operation = OP_NONE;
+                if ( script_line )
+                {
+                    fprintf( stderr, "Error in %s line %d\n", script_name, script_line );
+                    exit( 1 );
+                }
                 show_usage ( argv[ 0 ] );
                 break;
             }
         }
+
+        if ( operation != OP_NONE )
+        {
+            batch_add();
+            operation = OP_NONE;
+        }
     }
 }
 
 
-int main( int argc, char *argv[] )
+// Queue the operations in a script, one per line written as on the
+// command line ("-e button", "--enable button") or without the dashes
+// ("enable button").  Blank lines and lines starting with # are skipped.
+int script_load( void )
 {
-    int rc = 0;
-    char filename[ 20 ];
-
-    if ( argc == 1 )
-    {
-        show_usage( argv[ 0 ] );
-    }
-
-    parse( argc, argv );
+    FILE *fp = stdin;
+    char line[ 256 ];
+    char *argv[ SCRIPT_MAX_ARGS + 2 ];
+    char *word, *save;
+    int argc;
 
-    if ( operation != OP_VALUE )
-        printf( "Using I2C bus %d\n", i2c_bus );
-    
-    snprintf( filename, 19, "/dev/i2c-%d", i2c_bus );
-    handle = open( filename, O_RDWR );
-    if ( handle < 0 )
+    if ( strcmp( script_name, "-" ) != 0 )
     {
-        fprintf( stderr, "Error opening device %s: %s\n", filename, strerror ( errno ) );
-        exit( 1 );
+        fp = fopen( script_name, "r" );
+        if ( fp == NULL )
+        {
+            fprintf( stderr, "Error opening %s: %s\n", script_name, strerror( errno ) );
+            return -1;
+        }
     }
 
-    if ( ioctl( handle, I2C_SLAVE, stm_address ) < 0 )
+    while ( fgets( line, sizeof( line ), fp ) != NULL )
     {
-        close( handle );
-        fprintf( stderr, "IOCTL Error: %d\n", strerror ( errno ) );
-        exit( 1 );
-    }
+        script_line++;
+        argc = 0;
+        argv[ argc++ ] = script_name;
 
-    if ( operation != OP_UPLOAD ) 
-    {
-        if ( verify_product() )
+        for ( word = strtok_r( line, " \t\r\n", &save ); word != NULL; word = strtok_r( NULL, " \t\r\n", &save ) )
         {
-            if ( operation != OP_VALUE )
-                printf( "Board found at address 0x%X\n", stm_address );
+            if ( ( argc == 1 ) && ( word[ 0 ] == '#' ) )
+                break;
+
+            if ( argc > SCRIPT_MAX_ARGS )
+            {
+                fprintf( stderr, "Too many arguments in %s line %d\n", script_name, script_line );
+                parse_failed = 1;
+                break;
+            }
+
+            // Arguments are kept by the queued operations, so each gets a copy
+            if ( ( argc == 1 ) && ( word[ 0 ] != '-' ) )
+            {
+                argv[ argc ] = malloc( strlen( word ) + 3 );
+                if ( argv[ argc ] != NULL ) sprintf( argv[ argc ], "--%s", word );
+            }
+            else
+            {
+                argv[ argc ] = strdup( word );
+            }
+
+            if ( argv[ argc++ ] == NULL )
+            {
+                fprintf( stderr, "Out of memory reading %s\n", script_name );
+                parse_failed = 1;
+                break;
+            }
         }
-        else
+        argv[ argc ] = NULL;
+
+        if ( argc > 1 )
         {
-            close( handle );
-            fprintf( stderr, "No board found at 0x%X\n", stm_address );
-            exit( 1 );
+            optind = 0;
+            parse( argc, argv );
         }
     }
-    
+
+    if ( fp != stdin )
+    {
+        fclose( fp );
+    }
+    return 0;
+}
+
+
+int run_operation( void )
+{
+    int rc = 0;
+
     switch ( operation )
     {
         case OP_QUERY:
@@ -1496,6 +3271,18 @@ int main( int argc, char *argv[] )
             break;
         }
 
+        case OP_DAEMON:
+        {
+            rc = power_daemon();
+            break;
+        }
+
+        case OP_APPLY:
+        {
+            rc = cape_apply_config();
+            break;
+        }
+
         default:
         case OP_NONE:
         {
@@ -1503,6 +3290,151 @@ int main( int argc, char *argv[] )
         }
     }
 
-    close( handle );
+    return rc;
+}
+
+
+int main( int argc, char *argv[] )
+{
+    int i, rc = 0;
+    int daemon_fd = -1;
+    int quiet = 1;
+    int verify = 0;
+    char reply[ 64 ];
+
+    if ( argc == 1 )
+    {
+        show_usage( argv[ 0 ] );
+    }
+
+    parse( argc, argv );
+
+    if ( ( script_name != NULL ) && ( script_load() != 0 ) )
+    {
+        exit( 1 );
+    }
+
+    // Nothing is run if any of the operations was given a bad argument
+    if ( parse_failed )
+    {
+        exit( 1 );
+    }
+
+    for ( i = 0; i < batch_count; i++ )
+    {
+        if ( batch[ i ].operation != OP_VALUE ) quiet = 0;
+        if ( batch[ i ].operation != OP_UPLOAD ) verify = 1;
+        if ( ( batch[ i ].operation == OP_DAEMON ) && ( batch_count > 1 ) )
+        {
+            fprintf( stderr, "The daemon can't be combined with other operations\n" );
+            exit( 1 );
+        }
+    }
+    if ( batch_count > 0 )
+    {
+        batch_select( 0 );
+    }
+    else
+    {
+        quiet = 0;
+        verify = 1;
+    }
+
+    if ( fleet_count > 0 )
+    {
+        if ( ( operation != OP_UPLOAD ) || ( batch_count > 1 ) )
+        {
+            fprintf( stderr, "Target lists are only used for firmware upload\n" );
+            exit( 1 );
+        }
+        return fleet_upload();
+    }
+
+    // A running daemon answers value queries from its cache; anything else
+    // goes to the board directly while the daemon is held off the bus
+    if ( operation != OP_DAEMON )
+    {
+        daemon_fd = daemon_connect();
+    }
+    if ( daemon_fd >= 0 )
+    {
+        if ( ( operation == OP_VALUE ) && ( batch_count == 1 ) )
+        {
+            snprintf( reply, sizeof( reply ), "value %s\n", oper_arg );
+            if ( daemon_request( daemon_fd, reply, reply, sizeof( reply ) ) == 0 )
+            {
+                printf( "%s", reply );
+                close( daemon_fd );
+                return 0;
+            }
+        }
+        daemon_request( daemon_fd, "hold\n", reply, sizeof( reply ) );
+    }
+
+    if ( !quiet )
+        printf( "Using I2C bus %d\n", i2c_bus );
+    
+    if ( board_open( &stm, i2c_bus, stm_address ) != 0 )
+    {
+        exit( 1 );
+    }
+
+    // The bootloader doesn't answer as the product, anything else needs it to
+    if ( verify )
+    {
+        if ( verify_product() )
+        {
+            if ( !quiet )
+                printf( "Board found at address 0x%X\n", stm_address );
+        }
+        else
+        {
+            pu_close( &stm );
+            fprintf( stderr, "No board found at 0x%X\n", stm_address );
+            exit( 1 );
+        }
+    }
+
+    for ( i = 0; i < batch_count; i++ )
+    {
+        int op_rc;
+
+        batch_select( i );
+        op_rc = run_operation();
+        if ( op_rc != 0 )
+        {
+            if ( rc == 0 ) rc = op_rc;
+            if ( !keep_going )
+            {
+                if ( batch_count > 1 )
+                    fprintf( stderr, "Stopped at operation %d of %d\n", i + 1, batch_count );
+                break;
+            }
+        }
+    }
+
+    if ( show_stats )
+    {
+        show_command_stats();
+        fprintf( stderr, "\n%u command sequences locked, %u waited for another client (%u us)\n",
+                 stm.locks, stm.lock_contended, stm.lock_wait_us );
+    }
+
+    if ( stm.lock_unshared )
+    {
+        fprintf( stderr, "Warning: lock file in %s unusable, %u command sequence%s not protected from other processes\n",
+                 getenv( "PU_LOCK_DIR" ) ? getenv( "PU_LOCK_DIR" ) : PU_LOCK_DIR, stm.lock_unshared, ( stm.lock_unshared > 1 ) ? "s" : "" );
+    }
+
+    if ( stm.tears )
+    {
+        fprintf( stderr, "%d torn command data read%s detected and re-read\n", stm.tears, ( stm.tears > 1 ) ? "s" : "" );
+    }
+
+    if ( daemon_fd >= 0 )
+    {
+        close( daemon_fd );
+    }
+    pu_close( &stm );
     return rc;
 }
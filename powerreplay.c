@@ -0,0 +1,713 @@
+//
+// Record and replay of bus sessions for libpowerutils.
+//
+// pu_record() wraps a transport so every call made through it, with its
+// payload, result and duration, is appended to a file.  Replaying that
+// file through pu_replay_transport answers the same calls with the
+// recorded data, either taking as long as each call did on the real bus
+// or as fast as possible, so a session captured from a board can be run
+// again without it.  From the environment:
+//
+//   PU_RECORD=<file>           record whichever transport is in use
+//   PU_TRANSPORT=replay        replay PU_REPLAY=<file> instead of using a bus
+//   PU_REPLAY_SPEED=fast       don't wait out the recorded call durations
+//
+// Each opened descriptor is its own stream, so buses used from several
+// threads replay independently.  Within a stream calls must come in the
+// recorded order with the same writes; anything else fails with EPROTO.
+//
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "powerutils.h"
+
+#define RECORD_MAGIC        "PURC"
+#define RECORD_VERSION      1
+#define RECORD_STREAMS      64
+
+typedef enum
+{
+    CALL_OPEN = 1,
+    CALL_CLOSE,
+    CALL_IOCTL,
+    CALL_READ,
+    CALL_WRITE,
+} call_t;
+
+typedef struct
+{
+    char                magic[ 4 ];
+    uint16_t            version;
+    uint16_t            record_size;
+    uint64_t            realtime_ns;        // wall clock when recording started
+} record_header_t;
+
+// Followed by len bytes of payload: the data of a read or write, the funcs
+// of I2C_FUNCS as 64 bits, the messages of I2C_RDWR (record_msg_t then
+// data each) or the request and block of I2C_SMBUS
+typedef struct
+{
+    uint64_t            start_ns;           // since recording started
+    uint32_t            duration_ns;
+    int32_t             result;
+    uint32_t            request;            // ioctl request
+    uint16_t            stream;             // one per open descriptor
+    uint16_t            len;
+    uint8_t             call;
+    uint8_t             errnum;
+    uint16_t            arg;                // bus for open, address for I2C_SLAVE
+    uint32_t            reserved;
+} record_t;
+
+typedef struct
+{
+    uint16_t            addr;
+    uint16_t            flags;
+    uint16_t            len;
+} record_msg_t;
+
+typedef struct
+{
+    uint8_t             read_write;
+    uint8_t             command;
+    uint16_t            size;
+    uint8_t             block[ I2C_SMBUS_BLOCK_MAX + 2 ];
+} record_smbus_t;
+
+typedef struct
+{
+    record_t           *rec;
+    uint8_t            *payload;
+    int                 done;               // opens only, handed out already
+} replay_entry_t;
+
+typedef struct
+{
+    int                 used;
+    int                 fd;                 // descriptor from the wrapped transport
+    int                 next;               // replay position in entries
+} stream_t;
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static const pu_transport_t *record_inner = NULL;
+static FILE *record_fp = NULL;
+static uint64_t record_start;
+static stream_t streams[ RECORD_STREAMS ];
+
+static uint8_t *replay_data = NULL;
+static replay_entry_t *replay_entries = NULL;
+static int replay_count = 0;
+static int replay_fast = 0;
+
+
+static uint64_t monotonic_ns( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( (uint64_t)ts.tv_sec * 1000000000ULL ) + ts.tv_nsec;
+}
+
+
+// Payload of an ioctl as the recorder stores it and replay compares it.
+// Returns the length, or -1 for requests it doesn't know.
+static int ioctl_payload( unsigned long request, void *arg, uint8_t *out, int size )
+{
+    switch ( request )
+    {
+        case I2C_FUNCS:
+        {
+            // Fixed width, so captures from 32-bit boards replay on 64-bit hosts
+            uint64_t funcs = *(unsigned long *)arg;
+
+            memcpy( out, &funcs, sizeof( funcs ) );
+            return sizeof( funcs );
+        }
+        case I2C_SLAVE:
+        case I2C_SLAVE_FORCE:
+        {
+            return 0;
+        }
+        case I2C_RDWR:
+        {
+            struct i2c_rdwr_ioctl_data *xfer = arg;
+            record_msg_t m;
+            unsigned int i;
+            int len = 0;
+
+            for ( i = 0; i < xfer->nmsgs; i++ )
+            {
+                m.addr = xfer->msgs[ i ].addr;
+                m.flags = xfer->msgs[ i ].flags;
+                m.len = xfer->msgs[ i ].len;
+                if ( len + (int)sizeof( m ) + m.len > size )
+                    return -1;
+                memcpy( out + len, &m, sizeof( m ) );
+                memcpy( out + len + sizeof( m ), xfer->msgs[ i ].buf, m.len );
+                len += sizeof( m ) + m.len;
+            }
+            return len;
+        }
+        case I2C_SMBUS:
+        {
+            struct i2c_smbus_ioctl_data *args = arg;
+            record_smbus_t s;
+
+            memset( &s, 0, sizeof( s ) );
+            s.read_write = args->read_write;
+            s.command = args->command;
+            s.size = args->size;
+            if ( args->data != NULL ) memcpy( s.block, args->data->block, sizeof( s.block ) );
+            memcpy( out, &s, sizeof( s ) );
+            return sizeof( s );
+        }
+    }
+
+    return -1;
+}
+
+
+static void record_write( call_t call, int stream, uint64_t start, int result, int errnum,
+                          unsigned long request, int arg, const void *payload, int len )
+{
+    record_t r;
+
+    memset( &r, 0, sizeof( r ) );
+    r.start_ns = start - record_start;
+    r.duration_ns = monotonic_ns() - start;
+    r.result = result;
+    r.request = request;
+    r.stream = stream;
+    r.len = ( len > 0 ) ? len : 0;
+    r.call = call;
+    r.errnum = ( result < 0 ) ? errnum : 0;
+    r.arg = arg;
+
+    pthread_mutex_lock( &record_lock );
+    if ( record_fp != NULL )
+    {
+        fwrite( &r, sizeof( r ), 1, record_fp );
+        if ( r.len > 0 ) fwrite( payload, r.len, 1, record_fp );
+    }
+    pthread_mutex_unlock( &record_lock );
+}
+
+
+// Called with record_lock held
+static int stream_of( int fd )
+{
+    int i;
+
+    for ( i = 0; i < RECORD_STREAMS; i++ )
+    {
+        if ( streams[ i ].used && ( streams[ i ].fd == fd ) )
+            return i;
+    }
+
+    return -1;
+}
+
+
+static int record_open( int bus )
+{
+    uint64_t start = monotonic_ns();
+    int fd = record_inner->open( bus );
+    int errnum = errno;
+    int stream = -1;
+
+    if ( fd >= 0 )
+    {
+        pthread_mutex_lock( &record_lock );
+        for ( stream = 0; ( stream < RECORD_STREAMS ) && streams[ stream ].used; stream++ )
+            ;
+        if ( stream < RECORD_STREAMS )
+        {
+            streams[ stream ].used = 1;
+            streams[ stream ].fd = fd;
+        }
+        pthread_mutex_unlock( &record_lock );
+
+        if ( stream == RECORD_STREAMS )
+        {
+            record_inner->close( fd );
+            errno = EMFILE;
+            return -1;
+        }
+    }
+
+    record_write( CALL_OPEN, stream, start, fd, errnum, 0, bus, NULL, 0 );
+    errno = errnum;
+    return fd;
+}
+
+
+static int record_close( int fd )
+{
+    uint64_t start = monotonic_ns();
+    int rc = record_inner->close( fd );
+    int errnum = errno;
+    int stream;
+
+    pthread_mutex_lock( &record_lock );
+    stream = stream_of( fd );
+    if ( stream >= 0 ) streams[ stream ].used = 0;
+    pthread_mutex_unlock( &record_lock );
+
+    record_write( CALL_CLOSE, stream, start, rc, errnum, 0, 0, NULL, 0 );
+    errno = errnum;
+    return rc;
+}
+
+
+static int record_ioctl( int fd, unsigned long request, void *arg )
+{
+    uint8_t payload[ 4096 ];
+    uint64_t start = monotonic_ns();
+    int rc = record_inner->ioctl( fd, request, arg );
+    int errnum = errno;
+    int stream, len;
+
+    pthread_mutex_lock( &record_lock );
+    stream = stream_of( fd );
+    pthread_mutex_unlock( &record_lock );
+
+    len = ioctl_payload( request, arg, payload, sizeof( payload ) );
+    record_write( CALL_IOCTL, stream, start, rc, errnum, request,
+                  ( ( request == I2C_SLAVE ) || ( request == I2C_SLAVE_FORCE ) ) ? (int)(long)arg : 0, payload, len );
+    errno = errnum;
+    return rc;
+}
+
+
+static int record_read( int fd, void *buf, int len )
+{
+    uint64_t start = monotonic_ns();
+    int rc = record_inner->read( fd, buf, len );
+    int errnum = errno;
+    int stream;
+
+    pthread_mutex_lock( &record_lock );
+    stream = stream_of( fd );
+    pthread_mutex_unlock( &record_lock );
+
+    record_write( CALL_READ, stream, start, rc, errnum, 0, len, buf, ( rc > 0 ) ? rc : 0 );
+    errno = errnum;
+    return rc;
+}
+
+
+static int record_write_call( int fd, const void *buf, int len )
+{
+    uint64_t start = monotonic_ns();
+    int rc = record_inner->write( fd, buf, len );
+    int errnum = errno;
+    int stream;
+
+    pthread_mutex_lock( &record_lock );
+    stream = stream_of( fd );
+    pthread_mutex_unlock( &record_lock );
+
+    record_write( CALL_WRITE, stream, start, rc, errnum, 0, len, buf, len );
+    errno = errnum;
+    return rc;
+}
+
+
+static const pu_transport_t record_transport = {
+    "record", record_open, record_close, record_ioctl, record_read, record_write_call
+};
+
+
+static void record_stop( void )
+{
+    pthread_mutex_lock( &record_lock );
+    if ( record_fp != NULL )
+    {
+        fclose( record_fp );
+        record_fp = NULL;
+    }
+    pthread_mutex_unlock( &record_lock );
+}
+
+
+const pu_transport_t *pu_record( const pu_transport_t *inner, const char *path )
+{
+    record_header_t h;
+    struct timespec ts;
+
+    if ( ( inner == NULL ) || ( record_fp != NULL ) )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    record_fp = fopen( path, "wb" );
+    if ( record_fp == NULL )
+        return NULL;
+
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, RECORD_MAGIC, 4 );
+    h.version = RECORD_VERSION;
+    h.record_size = sizeof( record_t );
+    clock_gettime( CLOCK_REALTIME, &ts );
+    h.realtime_ns = ( (uint64_t)ts.tv_sec * 1000000000ULL ) + ts.tv_nsec;
+    fwrite( &h, sizeof( h ), 1, record_fp );
+
+    record_inner = inner;
+    record_start = monotonic_ns();
+    atexit( record_stop );
+    return &record_transport;
+}
+
+
+int pu_replay_load( const char *path, int fast )
+{
+    record_header_t h;
+    replay_entry_t *entries = NULL;
+    uint8_t *data = NULL;
+    long size, pos;
+    int count = 0;
+    FILE *fp;
+
+    fp = fopen( path, "rb" );
+    if ( fp == NULL )
+        return PU_ERR_OPEN;
+
+    fseek( fp, 0, SEEK_END );
+    size = ftell( fp );
+    rewind( fp );
+
+    if ( ( size < (long)sizeof( h ) ) || ( ( data = malloc( size ) ) == NULL ) ||
+         ( fread( data, size, 1, fp ) != 1 ) )
+    {
+        free( data );
+        fclose( fp );
+        return ( data == NULL ) ? PU_ERR_NOMEM : PU_ERR_IO;
+    }
+    fclose( fp );
+
+    memcpy( &h, data, sizeof( h ) );
+    if ( ( memcmp( h.magic, RECORD_MAGIC, 4 ) != 0 ) || ( h.version != RECORD_VERSION ) ||
+         ( h.record_size != sizeof( record_t ) ) )
+    {
+        free( data );
+        return PU_ERR_ARG;
+    }
+
+    // Index the records, a truncated last one is dropped
+    for ( pos = sizeof( h ); pos + (long)sizeof( record_t ) <= size; )
+    {
+        record_t *r = (record_t *)( data + pos );
+
+        if ( pos + (long)sizeof( record_t ) + r->len > size )
+            break;
+
+        if ( ( count % 1024 ) == 0 )
+        {
+            replay_entry_t *more = realloc( entries, ( count + 1024 ) * sizeof( *entries ) );
+
+            if ( more == NULL )
+            {
+                free( entries );
+                free( data );
+                return PU_ERR_NOMEM;
+            }
+            entries = more;
+        }
+        entries[ count ].rec = r;
+        entries[ count ].payload = data + pos + sizeof( record_t );
+        entries[ count ].done = 0;
+        count++;
+        pos += sizeof( record_t ) + r->len;
+    }
+
+    pthread_mutex_lock( &record_lock );
+    free( replay_entries );
+    free( replay_data );
+    replay_data = data;
+    replay_entries = entries;
+    replay_count = count;
+    replay_fast = fast;
+    memset( streams, 0, sizeof( streams ) );
+    pthread_mutex_unlock( &record_lock );
+
+    return PU_OK;
+}
+
+
+// Take as long as the call did when it was recorded
+static void replay_wait( uint64_t start, const record_t *r )
+{
+    uint64_t until = start + r->duration_ns;
+    struct timespec ts;
+    uint64_t now;
+
+    if ( replay_fast )
+        return;
+
+    // Sleep the bulk of long waits, spin the rest for accuracy
+    now = monotonic_ns();
+    if ( until > now + 2000000 )
+    {
+        ts.tv_sec = ( until - 1000000 - now ) / 1000000000ULL;
+        ts.tv_nsec = ( until - 1000000 - now ) % 1000000000ULL;
+        nanosleep( &ts, NULL );
+    }
+    while ( monotonic_ns() < until )
+        ;
+}
+
+
+// The next record of the stream behind fd, or NULL with errno set if the
+// session has run out or gone a different way
+static const replay_entry_t *replay_next( int fd, call_t call )
+{
+    const replay_entry_t *e = NULL;
+    stream_t *s;
+    int i;
+
+    pthread_mutex_lock( &record_lock );
+    if ( ( fd >= 0 ) && ( fd < RECORD_STREAMS ) && streams[ fd ].used )
+    {
+        s = &streams[ fd ];
+        for ( i = s->next; i < replay_count; i++ )
+        {
+            if ( replay_entries[ i ].rec->stream == fd )
+                break;
+        }
+        if ( i < replay_count )
+        {
+            s->next = i + 1;
+            e = &replay_entries[ i ];
+        }
+    }
+    pthread_mutex_unlock( &record_lock );
+
+    if ( ( e == NULL ) || ( e->rec->call != call ) )
+    {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return e;
+}
+
+
+static int replay_result( const replay_entry_t *e, uint64_t start )
+{
+    replay_wait( start, e->rec );
+    if ( e->rec->result < 0 )
+    {
+        errno = e->rec->errnum;
+    }
+
+    return e->rec->result;
+}
+
+
+// Streams are handed out again in the order the recording opened them, so
+// the replayed descriptor is the stream number
+static int replay_open( int bus )
+{
+    uint64_t start = monotonic_ns();
+    const char *path;
+    const char *speed;
+    record_t *r = NULL;
+    int i;
+
+    if ( replay_entries == NULL )
+    {
+        path = getenv( "PU_REPLAY" );
+        speed = getenv( "PU_REPLAY_SPEED" );
+        if ( ( path == NULL ) || ( pu_replay_load( path, ( speed != NULL ) && ( strcmp( speed, "fast" ) == 0 ) ) != PU_OK ) )
+        {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock( &record_lock );
+    for ( i = 0; i < replay_count; i++ )
+    {
+        r = replay_entries[ i ].rec;
+        if ( ( r->call == CALL_OPEN ) && ( r->arg == bus ) && !replay_entries[ i ].done )
+        {
+            replay_entries[ i ].done = 1;
+            if ( r->result >= 0 )
+            {
+                if ( ( r->stream >= RECORD_STREAMS ) || streams[ r->stream ].used )
+                {
+                    i = replay_count;
+                    break;
+                }
+                streams[ r->stream ].used = 1;
+                streams[ r->stream ].next = i + 1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock( &record_lock );
+
+    if ( i == replay_count )
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    replay_wait( start, r );
+    if ( r->result < 0 )
+    {
+        errno = r->errnum;
+        return -1;
+    }
+    return r->stream;
+}
+
+
+static int replay_close( int fd )
+{
+    uint64_t start = monotonic_ns();
+    const replay_entry_t *e = replay_next( fd, CALL_CLOSE );
+
+    pthread_mutex_lock( &record_lock );
+    if ( ( fd >= 0 ) && ( fd < RECORD_STREAMS ) ) streams[ fd ].used = 0;
+    pthread_mutex_unlock( &record_lock );
+
+    return ( e != NULL ) ? replay_result( e, start ) : -1;
+}
+
+
+static int replay_ioctl( int fd, unsigned long request, void *arg )
+{
+    uint8_t payload[ 4096 ];
+    uint64_t start = monotonic_ns();
+    const replay_entry_t *e = replay_next( fd, CALL_IOCTL );
+    const record_t *r;
+    int len, pos;
+    unsigned int i;
+
+    if ( e == NULL )
+        return -1;
+    r = e->rec;
+
+    len = ioctl_payload( request, arg, payload, sizeof( payload ) );
+    if ( ( r->request != request ) || ( len != r->len ) )
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    switch ( request )
+    {
+        case I2C_FUNCS:
+        {
+            uint64_t funcs;
+
+            memcpy( &funcs, e->payload, sizeof( funcs ) );
+            *(unsigned long *)arg = funcs;
+            break;
+        }
+        case I2C_SLAVE:
+        case I2C_SLAVE_FORCE:
+        {
+            if ( r->arg != (long)arg )
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            break;
+        }
+        case I2C_RDWR:
+        {
+            struct i2c_rdwr_ioctl_data *xfer = arg;
+
+            // Same messages with the same writes, then hand back what was read
+            for ( i = 0, pos = 0; i < xfer->nmsgs; i++ )
+            {
+                struct i2c_msg *m = &xfer->msgs[ i ];
+
+                if ( !( m->flags & I2C_M_RD ) &&
+                     ( memcmp( payload + pos, e->payload + pos, sizeof( record_msg_t ) + m->len ) != 0 ) )
+                {
+                    errno = EPROTO;
+                    return -1;
+                }
+                if ( ( m->flags & I2C_M_RD ) &&
+                     ( memcmp( payload + pos, e->payload + pos, sizeof( record_msg_t ) ) != 0 ) )
+                {
+                    errno = EPROTO;
+                    return -1;
+                }
+                pos += sizeof( record_msg_t );
+                if ( m->flags & I2C_M_RD ) memcpy( m->buf, e->payload + pos, m->len );
+                pos += m->len;
+            }
+            break;
+        }
+        case I2C_SMBUS:
+        {
+            struct i2c_smbus_ioctl_data *args = arg;
+            record_smbus_t s;
+
+            memcpy( &s, e->payload, sizeof( s ) );
+            if ( ( s.read_write != args->read_write ) || ( s.command != args->command ) || ( s.size != args->size ) )
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            if ( args->data != NULL ) memcpy( args->data->block, s.block, sizeof( s.block ) );
+            break;
+        }
+    }
+
+    return replay_result( e, start );
+}
+
+
+static int replay_read( int fd, void *buf, int len )
+{
+    uint64_t start = monotonic_ns();
+    const replay_entry_t *e = replay_next( fd, CALL_READ );
+
+    if ( e == NULL )
+        return -1;
+
+    if ( e->rec->arg != len )
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy( buf, e->payload, e->rec->len );
+
+    return replay_result( e, start );
+}
+
+
+static int replay_write( int fd, const void *buf, int len )
+{
+    uint64_t start = monotonic_ns();
+    const replay_entry_t *e = replay_next( fd, CALL_WRITE );
+
+    if ( e == NULL )
+        return -1;
+
+    if ( ( e->rec->len != len ) || ( memcmp( buf, e->payload, len ) != 0 ) )
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return replay_result( e, start );
+}
+
+
+const pu_transport_t pu_replay_transport = {
+    "replay", replay_open, replay_close, replay_ioctl, replay_read, replay_write
+};
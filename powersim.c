@@ -0,0 +1,981 @@
+//
+// Simulated Power HAT for libpowerutils: the STM power controller (register
+// map, commands and bootloader from regs.h) and the INA219 battery monitor,
+// served in-process in place of /dev/i2c-N.  Selected with PU_TRANSPORT=sim
+// or pu_set_transport( &pu_sim_transport ), and set up from the environment:
+//
+//   PU_SIM_DEVICES     bus:addr:stm|ina219,...  (default an STM at 0x60 and
+//                      an INA219 at 0x40 on every bus)
+//   PU_SIM_KHZ         bus clock transfers are paced at, 0 for no delay (100)
+//   PU_SIM_COMMAND_US  time the controller takes per command (200)
+//   PU_SIM_FLASH_US    time per bootloader erase or half page program (3000)
+//   PU_SIM_BOOT        start controllers in the bootloader
+//   PU_SIM_STATS       file to append the run's transfer counts to at exit
+//   PU_SIM_FLASH       file to save controller flash to at exit, one per
+//                      controller as <file>.<bus>-<addr>
+//
+// and, to try timeouts and retries against a misbehaving bus or board:
+//
+//   PU_SIM_LATENCY     extra time per transaction, as clock stretching (0)
+//   PU_SIM_NAK         percentage of transactions NAKed
+//   PU_SIM_STUCK       percentage of commands that never complete, or pct:value
+//                      for REG_COMMAND to end up stuck at value instead
+//   PU_SIM_FLASH_FAIL  percentage of erase/program operations that fail
+//   PU_SIM_BOOT_MS     time the controller is off the bus after a reboot or
+//                      entering or leaving the bootloader (0)
+//   PU_SIM_SEED        random seed for the above, for repeatable runs
+//
+// Times are microseconds, either fixed, <min>-<max> for a uniform spread or
+// exp:<mean> for exponentially distributed.
+//
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "powerutils.h"
+
+#define SIM_BUSES           16
+#define SIM_FDS             32
+#define SIM_FLASH_SIZE      ( 1024 * 16 )
+#define SIM_HALF_PAGE       64
+#define SIM_FLASH_ERASED    0x00                    // STM32L0 flash erases to zero
+#define SIM_RESTART_NS      ( 20 * 1000000ULL )     // command finished to reset
+
+#define SIM_BATTERY_MV      4100
+#define SIM_BATTERY_MA      -350        // charging
+#define SIM_SHUNT_UOHMS     10000
+#define SIM_ONTIME          12345
+#define SIM_OFFTIME         99
+#define SIM_BUILD_TIME      1514764800
+#define SIM_FIRMWARE_TIME   1546300800
+
+#define INA_CONFIG_RESET    0x399F
+
+typedef enum
+{
+    SIM_NONE,
+    SIM_STM,
+    SIM_INA219,
+} sim_type_t;
+
+typedef struct
+{
+    sim_type_t      type;
+    int             bus;
+    int             address;
+    uint8_t         ptr;                // register pointer
+
+    // STM
+    int             boot;               // running the bootloader
+    uint8_t         map[ NUM_REGISTERS ];
+    uint8_t         boot_regs[ BOOT_NUM_REGS ];
+    uint64_t        busy_until;         // command or flash operation in progress
+    uint64_t        restart_at;         // reset requested by a command
+    int             restart_boot;       // into the bootloader
+    uint64_t        offline_until;      // rebooting, NAKs everything
+    int             pending;
+    int             stuck;              // pending command won't complete normally
+    int             data_pos;
+    uint8_t         half_page[ SIM_HALF_PAGE ];
+    uint8_t         flash[ SIM_FLASH_SIZE ];
+    uint8_t         charge_rate;
+    uint32_t        restart_time;
+    uint32_t        rtc_cal;
+    int64_t         rtc_offset;
+    uint64_t        started;
+
+    // INA219
+    uint16_t        regs[ 6 ];
+    uint64_t        convert_from;       // start of the conversion sequence
+    uint64_t        power_read;         // last POWER_REG read, clears CNVR
+} sim_device_t;
+
+typedef struct
+{
+    int             used;
+    int             bus;
+    int             slave;
+} sim_fd_t;
+
+typedef struct
+{
+    unsigned long   syscalls;
+    unsigned long   transactions;       // START to STOP, repeated starts included
+    unsigned long   messages;
+    unsigned long   bytes;
+    uint64_t        bus_ns;             // time on the wire at the simulated clock
+    unsigned long   faults;             // NAKs, stuck commands and flash errors injected
+} sim_stats_t;
+
+typedef enum
+{
+    SIM_FIXED,
+    SIM_UNIFORM,
+    SIM_EXP,
+} sim_spread_t;
+
+typedef struct
+{
+    sim_spread_t    spread;
+    unsigned int    us;                 // fixed, minimum or mean
+    unsigned int    max_us;
+} sim_time_t;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_device_t *sim_devices[ SIM_BUSES ][ 128 ];
+static int sim_bus_ready[ SIM_BUSES ];
+static sim_fd_t sim_fds[ SIM_FDS ];
+static sim_stats_t sim_stats;
+static int sim_khz = -1;
+static sim_time_t sim_command_time;
+static sim_time_t sim_flash_time;
+static sim_time_t sim_latency;
+static double sim_nak;
+static double sim_stuck;
+static int sim_stuck_value = -1;        // -1 leaves the command in REG_COMMAND
+static double sim_flash_fail;
+static unsigned int sim_boot_ms;
+static uint64_t sim_seed;
+
+
+static uint64_t sim_now( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( (uint64_t)ts.tv_sec * 1000000000ULL ) + ts.tv_nsec;
+}
+
+
+static int sim_env( const char *name, int def )
+{
+    const char *value = getenv( name );
+
+    return ( value != NULL ) ? atoi( value ) : def;
+}
+
+
+static double sim_env_double( const char *name )
+{
+    const char *value = getenv( name );
+
+    return ( value != NULL ) ? atof( value ) : 0;
+}
+
+
+static void sim_env_time( sim_time_t *t, const char *name, unsigned int def )
+{
+    const char *value = getenv( name );
+    char *end;
+
+    t->spread = SIM_FIXED;
+    t->us = def;
+    if ( value == NULL )
+        return;
+
+    if ( strncmp( value, "exp:", 4 ) == 0 )
+    {
+        t->spread = SIM_EXP;
+        t->us = strtoul( value + 4, NULL, 0 );
+        return;
+    }
+
+    t->us = strtoul( value, &end, 0 );
+    if ( *end == '-' )
+    {
+        t->spread = SIM_UNIFORM;
+        t->max_us = strtoul( end + 1, NULL, 0 );
+        if ( t->max_us < t->us ) t->max_us = t->us;
+    }
+}
+
+
+// xorshift64*, uniform over [0,1).  Called with sim_lock held.
+static double sim_random( void )
+{
+    sim_seed ^= sim_seed >> 12;
+    sim_seed ^= sim_seed << 25;
+    sim_seed ^= sim_seed >> 27;
+    return ( ( sim_seed * 2685821657736338717ULL ) >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+
+static int sim_chance( double percent )
+{
+    return ( percent > 0 ) && ( sim_random() * 100 < percent );
+}
+
+
+// Natural log for the exponential spread, saves linking libm into the tools
+static double sim_ln( double x )
+{
+    double y, y2, term, sum = 0;
+    int n, k = 0;
+
+    while ( x >= 2 ) { x /= 2; k++; }
+    while ( x < 1 ) { x *= 2; k--; }
+
+    y = ( x - 1 ) / ( x + 1 );
+    y2 = y * y;
+    term = y;
+    for ( n = 1; n < 32; n += 2 )
+    {
+        sum += term / n;
+        term *= y2;
+    }
+    return 2 * sum + k * 0.69314718055994530942;
+}
+
+
+static uint64_t sim_time_ns( const sim_time_t *t )
+{
+    double us;
+
+    switch ( t->spread )
+    {
+        case SIM_UNIFORM:   us = t->us + ( t->max_us - t->us ) * sim_random(); break;
+        case SIM_EXP:       us = -( t->us * sim_ln( 1.0 - sim_random() ) ); break;
+        default:            us = t->us; break;
+    }
+    return (uint64_t)( us * 1000 );
+}
+
+
+static void sim_report( void )
+{
+    const char *path = getenv( "PU_SIM_STATS" );
+    FILE *fp;
+
+    if ( ( path == NULL ) || ( ( fp = fopen( path, "a" ) ) == NULL ) )
+        return;
+
+    fprintf( fp, "%lu %lu %lu %lu %llu %lu\n", sim_stats.syscalls, sim_stats.transactions,
+             sim_stats.messages, sim_stats.bytes, (unsigned long long)( sim_stats.bus_ns / 1000 ),
+             sim_stats.faults );
+    fclose( fp );
+}
+
+
+static void sim_save_flash( void )
+{
+    const char *path = getenv( "PU_SIM_FLASH" );
+    char name[ 256 ];
+    FILE *fp;
+    int b, a;
+
+    if ( path == NULL )
+        return;
+
+    for ( b = 0; b < SIM_BUSES; b++ )
+    {
+        for ( a = 0; a < 128; a++ )
+        {
+            if ( ( sim_devices[ b ][ a ] == NULL ) || ( sim_devices[ b ][ a ]->type != SIM_STM ) )
+                continue;
+
+            snprintf( name, sizeof( name ), "%s.%d-%02X", path, b, a );
+            if ( ( fp = fopen( name, "wb" ) ) == NULL )
+                continue;
+            fwrite( sim_devices[ b ][ a ]->flash, SIM_FLASH_SIZE, 1, fp );
+            fclose( fp );
+        }
+    }
+}
+
+
+static void sim_setup( void )
+{
+    const char *stuck = getenv( "PU_SIM_STUCK" );
+    const char *value;
+
+    if ( sim_khz >= 0 )
+        return;
+
+    sim_khz = sim_env( "PU_SIM_KHZ", 100 );
+    sim_env_time( &sim_command_time, "PU_SIM_COMMAND_US", 200 );
+    sim_env_time( &sim_flash_time, "PU_SIM_FLASH_US", 3000 );
+    sim_env_time( &sim_latency, "PU_SIM_LATENCY", 0 );
+    sim_nak = sim_env_double( "PU_SIM_NAK" );
+    sim_flash_fail = sim_env_double( "PU_SIM_FLASH_FAIL" );
+    sim_boot_ms = sim_env( "PU_SIM_BOOT_MS", 0 );
+    if ( stuck != NULL )
+    {
+        sim_stuck = atof( stuck );
+        if ( ( value = strchr( stuck, ':' ) ) != NULL ) sim_stuck_value = strtol( value + 1, NULL, 0 ) & 0xFF;
+    }
+
+    value = getenv( "PU_SIM_SEED" );
+    sim_seed = ( value != NULL ) ? strtoull( value, NULL, 0 ) : ( sim_now() ^ ( (uint64_t)getpid() << 32 ) );
+    if ( sim_seed == 0 ) sim_seed = 1;
+
+    atexit( sim_report );
+    atexit( sim_save_flash );
+}
+
+
+static sim_device_t *sim_add( int bus, int address, sim_type_t type )
+{
+    sim_device_t *d = calloc( 1, sizeof( *d ) );
+
+    if ( d == NULL )
+        return NULL;
+
+    d->type = type;
+    d->bus = bus;
+    d->address = address;
+    d->started = sim_now();
+
+    if ( type == SIM_STM )
+    {
+        d->map[ REG_ID ] = 0xED;
+        d->map[ REG_PROD ] = PROD_POWERHAT;
+        d->map[ REG_STEP ] = 'A';
+        d->map[ REG_REVISION ] = '2';
+        d->map[ REG_VERSION_MAJOR ] = FIRMWARE_MAJOR;
+        d->map[ REG_VERSION_MINOR ] = FIRMWARE_MINOR;
+        d->map[ REG_STATUS ] = STATUS_POWER_GOOD | STATUS_BOOTLOADER;
+        d->map[ REG_CONTROL ] = CONTROL_CHARGE_ENABLE;
+        d->map[ REG_START_ENABLE ] = START_BUTTON | START_PWR_ON;
+        d->map[ REG_START_REASON ] = START_PWR_ON;
+        d->map[ REG_END ] = 0xEE;
+        d->boot_regs[ BOOT_REG_ID ] = 0xBB;
+        d->boot_regs[ BOOT_REG_LEVEL ] = 1;
+        d->boot = ( getenv( "PU_SIM_BOOT" ) != NULL );
+        d->charge_rate = 2;
+        d->restart_time = 3600;
+        memset( d->flash, SIM_FLASH_ERASED, sizeof( d->flash ) );
+    }
+    else
+    {
+        d->regs[ 0 ] = INA_CONFIG_RESET;
+        d->convert_from = d->started;
+    }
+
+    sim_devices[ bus ][ address ] = d;
+    return d;
+}
+
+
+// Devices for a bus are created the first time it is opened
+static void sim_bus_setup( int bus )
+{
+    const char *list = getenv( "PU_SIM_DEVICES" );
+    char *copy, *item, *save, *end;
+    int b, a;
+
+    if ( sim_bus_ready[ bus ] )
+        return;
+    sim_bus_ready[ bus ] = 1;
+
+    if ( list == NULL )
+    {
+        sim_add( bus, 0x60, SIM_STM );
+        sim_add( bus, 0x40, SIM_INA219 );
+        return;
+    }
+
+    copy = strdup( list );
+    for ( item = strtok_r( copy, ",", &save ); item != NULL; item = strtok_r( NULL, ",", &save ) )
+    {
+        b = (int)strtol( item, &end, 0 );
+        if ( ( b != bus ) || ( *end != ':' ) )
+            continue;
+        a = (int)strtol( end + 1, &end, 0 );
+        if ( ( a < 0 ) || ( a > 127 ) || ( *end != ':' ) )
+            continue;
+        sim_add( bus, a, ( strcmp( end + 1, "ina219" ) == 0 ) ? SIM_INA219 : SIM_STM );
+    }
+    free( copy );
+}
+
+
+// Hold the caller for the time the transfer would take on the wire, so
+// wall time tracks what the same traffic costs on a real bus
+static void sim_wire( int messages, int bytes )
+{
+    uint64_t ns, until;
+
+    // START/STOP or repeated START plus the address byte per message,
+    // nine clocks per byte with its ACK
+    ns = sim_khz ? ( (uint64_t)( messages * 11 + bytes * 9 ) * 1000000ULL / sim_khz ) : 0;
+
+    pthread_mutex_lock( &sim_lock );
+    ns += sim_time_ns( &sim_latency );
+    sim_stats.transactions++;
+    sim_stats.messages += messages;
+    sim_stats.bytes += bytes;
+    sim_stats.bus_ns += ns;
+    pthread_mutex_unlock( &sim_lock );
+
+    until = sim_now() + ns;
+    while ( sim_now() < until )
+        ;
+}
+
+
+// The controller drops off the bus while it restarts
+static void stm_restart( sim_device_t *d, int boot )
+{
+    d->boot = boot;
+    d->started = sim_now();
+    d->offline_until = d->started + sim_boot_ms * 1000000ULL;
+}
+
+
+static void stm_command( sim_device_t *d )
+{
+    uint8_t *m = d->map;
+    uint8_t command = m[ REG_COMMAND ];
+    uint32_t data = m[ REG_DATA_0 ] | ( m[ REG_DATA_1 ] << 8 ) | ( m[ REG_DATA_2 ] << 16 ) | ( (uint32_t)m[ REG_DATA_3 ] << 24 );
+    uint32_t out = 0;
+    int reply = 1;
+    int status = 0;
+
+    switch ( command )
+    {
+        case COMMAND_CHARGE_ENABLE:      m[ REG_CONTROL ] |= CONTROL_CHARGE_ENABLE; reply = 0; break;
+        case COMMAND_CHARGE_DISABLE:     m[ REG_CONTROL ] &= ~CONTROL_CHARGE_ENABLE; reply = 0; break;
+        case COMMAND_EXT_PWR_ON:         m[ REG_STATUS ] |= STATUS_EXT_POWER; reply = 0; break;
+        case COMMAND_EXT_PWR_OFF:        m[ REG_STATUS ] &= ~STATUS_EXT_POWER; reply = 0; break;
+        case COMMAND_SET_RESTART_TIME:   d->restart_time = data; reply = 0; break;
+        case COMMAND_GET_RESTART_TIME:   out = d->restart_time; break;
+        case COMMAND_CLEAR_RESTART_TIME: d->restart_time = 0; reply = 0; break;
+        case COMMAND_GET_ONTIME:         out = SIM_ONTIME + ( sim_now() - d->started ) / 1000000000ULL; break;
+        case COMMAND_GET_OFFTIME:        out = SIM_OFFTIME; break;
+        case COMMAND_GET_CHARGE_RATE:    out = d->charge_rate; break;
+        case COMMAND_SET_CHARGE_RATE_1:
+        case COMMAND_SET_CHARGE_RATE_2:
+        case COMMAND_SET_CHARGE_RATE_3:  d->charge_rate = command - COMMAND_SET_CHARGE_RATE_1 + 1; reply = 0; break;
+        case COMMAND_FIRMWARE_TIMESTAMP: out = SIM_FIRMWARE_TIME; break;
+        case COMMAND_LOADER_TIMESTAMP:   out = SIM_FIRMWARE_TIME; break;
+        case COMMAND_READ_COUNT:         out = (uint32_t)( time( NULL ) + d->rtc_offset ); break;
+        case COMMAND_WRITE_COUNT:        d->rtc_offset = (int64_t)data - time( NULL ); reply = 0; break;
+        case COMMAND_GET_RTC_CAL:        out = d->rtc_cal; break;
+        case COMMAND_SET_RTC_CAL:        d->rtc_cal = data; reply = 0; break;
+        case COMMAND_GET_TIMESTAMP:      out = SIM_BUILD_TIME; break;
+        case COMMAND_GET_SERIAL:
+        {
+            static const char hex[] = "0123456789ABCDEF";
+
+            // Reads as S<bus><addr>, unique per simulated board
+            out = ( 'S' << 24 ) | ( hex[ d->bus & 0xF ] << 16 ) | ( hex[ d->address >> 4 ] << 8 ) | hex[ d->address & 0xF ];
+            break;
+        }
+        case COMMAND_SET_I2C_ADDRESS:
+        {
+            if ( ( data < 0x08 ) || ( data > 0x77 ) ) status = 0xEA;
+            reply = 0;
+            break;
+        }
+        case COMMAND_LED_ON_MS:
+        case COMMAND_LED_OFF_MS:
+        case COMMAND_SET_RTC_ADDRESS:
+        case COMMAND_DISARM_VCC:
+        case COMMAND_ARM_VCC:
+        case COMMAND_EEPROM_CLEAR:
+        case COMMAND_EEPROM_STORE:      reply = 0; break;
+        case COMMAND_REBOOT:
+        case COMMAND_ENTER_BOOTLOADER:
+        {
+            // Resets shortly after reporting the command done
+            d->restart_at = sim_now() + SIM_RESTART_NS;
+            d->restart_boot = ( command == COMMAND_ENTER_BOOTLOADER );
+            reply = 0;
+            break;
+        }
+        default:                        status = 0xEC; reply = 0; break;
+    }
+
+    if ( reply )
+    {
+        m[ REG_DATA_0 ] = out;
+        m[ REG_DATA_1 ] = out >> 8;
+        m[ REG_DATA_2 ] = out >> 16;
+        m[ REG_DATA_3 ] = out >> 24;
+    }
+    m[ REG_COMMAND ] = status;
+    d->pending = 0;
+}
+
+
+static uint8_t stm_read( sim_device_t *d, uint8_t reg )
+{
+    if ( d->pending && ( sim_now() >= d->busy_until ) )
+    {
+        if ( !d->stuck )
+        {
+            stm_command( d );
+        }
+        else if ( sim_stuck_value >= 0 )
+        {
+            d->map[ REG_COMMAND ] = sim_stuck_value;
+            d->pending = 0;
+        }
+    }
+
+    if ( d->boot )
+    {
+        if ( reg == BOOT_REG_STATUS )
+        {
+            if ( ( d->boot_regs[ BOOT_REG_CMD ] != BOOT_CMD_ERROR ) && ( sim_now() < d->busy_until ) )
+                return d->boot_regs[ BOOT_REG_CMD ];
+            if ( d->boot_regs[ BOOT_REG_CMD ] == BOOT_CMD_ERROR )
+            {
+                d->boot_regs[ BOOT_REG_CMD ] = BOOT_CMD_NOP;
+                return BOOT_CMD_ERROR;
+            }
+            d->boot_regs[ BOOT_REG_CMD ] = BOOT_CMD_NOP;
+            return BOOT_CMD_NOP;
+        }
+        return ( reg < BOOT_NUM_REGS ) ? d->boot_regs[ reg ] : 0xFF;
+    }
+
+    return ( reg < NUM_REGISTERS ) ? d->map[ reg ] : 0xFF;
+}
+
+
+static void boot_command( sim_device_t *d, uint8_t command )
+{
+    int addr = d->boot_regs[ BOOT_REG_ADDR ];
+
+    if ( ( command != BOOT_CMD_EXECUTE ) && sim_chance( sim_flash_fail ) )
+    {
+        sim_stats.faults++;
+        d->boot_regs[ BOOT_REG_CMD ] = BOOT_CMD_ERROR;
+        return;
+    }
+
+    switch ( command )
+    {
+        case BOOT_CMD_PAGE_ERASE:
+        {
+            if ( ( addr / 2 + 1 ) * SIM_HALF_PAGE * 2 <= SIM_FLASH_SIZE )
+                memset( d->flash + ( addr / 2 ) * SIM_HALF_PAGE * 2, SIM_FLASH_ERASED, SIM_HALF_PAGE * 2 );
+            break;
+        }
+        case BOOT_CMD_FULL_ERASE:
+        {
+            memset( d->flash, SIM_FLASH_ERASED, sizeof( d->flash ) );
+            break;
+        }
+        case BOOT_CMD_HALF_PAGE_PROG:
+        {
+            if ( ( addr + 1 ) * SIM_HALF_PAGE <= SIM_FLASH_SIZE )
+                memcpy( d->flash + addr * SIM_HALF_PAGE, d->half_page, SIM_HALF_PAGE );
+            break;
+        }
+        case BOOT_CMD_EXECUTE:
+        {
+            stm_restart( d, 0 );
+            return;
+        }
+        default:
+        {
+            d->boot_regs[ BOOT_REG_CMD ] = BOOT_CMD_ERROR;
+            return;
+        }
+    }
+
+    d->boot_regs[ BOOT_REG_CMD ] = command;
+    d->busy_until = sim_now() + sim_time_ns( &sim_flash_time );
+}
+
+
+static void stm_write( sim_device_t *d, uint8_t reg, uint8_t value )
+{
+    if ( d->boot )
+    {
+        switch ( reg )
+        {
+            case BOOT_REG_ADDR:     d->boot_regs[ reg ] = value; d->data_pos = 0; break;
+            case BOOT_REG_DATA:     d->half_page[ d->data_pos++ % SIM_HALF_PAGE ] = value; break;
+            case BOOT_REG_CMD:      boot_command( d, value ); break;
+        }
+        return;
+    }
+
+    switch ( reg )
+    {
+        case REG_CONTROL:
+        case REG_START_ENABLE:
+        case REG_DATA_0:
+        case REG_DATA_1:
+        case REG_DATA_2:
+        case REG_DATA_3:
+        case REG_WDT_POWER:
+        case REG_WDT_STOP:
+        case REG_WDT_START:
+        {
+            d->map[ reg ] = value;
+            break;
+        }
+        case REG_COMMAND:
+        {
+            d->map[ reg ] = value;
+            d->pending = 1;
+            d->busy_until = sim_now() + sim_time_ns( &sim_command_time );
+            if ( ( d->stuck = sim_chance( sim_stuck ) ) ) sim_stats.faults++;
+            break;
+        }
+    }
+}
+
+
+static int ina_adc_us( int adc )
+{
+    static const int us[ 16 ] = {
+        84, 148, 276, 532, 84, 148, 276, 532,
+        532, 1060, 2130, 4260, 8510, 17020, 34050, 68100
+    };
+
+    return us[ adc & 0xF ];
+}
+
+
+// Conversion results for the configured gain and calibration, with CNVR
+// set once a conversion has finished since POWER_REG was last read
+static uint16_t ina_read( sim_device_t *d, uint8_t reg )
+{
+    uint16_t config = d->regs[ 0 ];
+    int mode = config & 0x7;
+    int pg = ( config >> 11 ) & 0x3;
+    uint64_t now = sim_now();
+    uint64_t period, done = 0;
+    int32_t shunt, current;
+    uint16_t bus;
+
+    period = ( ( ( mode & 1 ) ? ina_adc_us( config >> 3 ) : 0 ) + ( ( mode & 2 ) ? ina_adc_us( config >> 7 ) : 0 ) ) * 1000ULL;
+    if ( ( period > 0 ) && ( now >= d->convert_from + period ) )
+    {
+        // Triggered modes convert once per CONFIG write, the rest continuously
+        done = ( mode < 4 ) ? d->convert_from + period : d->convert_from + ( ( now - d->convert_from ) / period ) * period;
+    }
+
+    shunt = (int32_t)SIM_BATTERY_MA * SIM_SHUNT_UOHMS / 10000;      // 10uV counts
+    bus = ( ( SIM_BATTERY_MV / 4 ) << 3 );
+    if ( abs( shunt ) > ( 4000 << pg ) )
+    {
+        bus |= 0x1;
+        shunt = ( shunt < 0 ) ? -( 4000 << pg ) : ( 4000 << pg );
+    }
+    if ( ( done > 0 ) && ( done > d->power_read ) )
+    {
+        bus |= 0x2;
+    }
+    current = shunt * d->regs[ 5 ] / 4096;
+
+    switch ( reg )
+    {
+        case 1:     return (uint16_t)shunt;
+        case 2:     return bus;
+        case 3:
+        {
+            d->power_read = now;
+            return (uint16_t)( abs( current ) * ( bus >> 3 ) / 5000 );
+        }
+        case 4:     return (uint16_t)current;
+        default:    return ( reg < 6 ) ? d->regs[ reg ] : 0xFFFF;
+    }
+}
+
+
+static void ina_write( sim_device_t *d, uint8_t reg, uint16_t value )
+{
+    if ( reg == 0 )
+    {
+        d->regs[ 0 ] = ( value & 0x8000 ) ? INA_CONFIG_RESET : value;
+        if ( value & 0x8000 ) d->regs[ 5 ] = 0;
+        d->convert_from = sim_now();
+    }
+    else if ( reg == 5 )
+    {
+        d->regs[ 5 ] = value & 0xFFFE;
+    }
+}
+
+
+// A write message sets the register pointer, any further bytes are data
+static void sim_dev_write( sim_device_t *d, const uint8_t *buf, int len )
+{
+    int i;
+
+    if ( len < 1 )
+        return;
+
+    d->ptr = buf[ 0 ];
+    if ( d->type == SIM_INA219 )
+    {
+        if ( len >= 3 ) ina_write( d, d->ptr, ( buf[ 1 ] << 8 ) | buf[ 2 ] );
+        return;
+    }
+
+    for ( i = 1; i < len; i++ )
+    {
+        // The bootloader's data register takes a stream of bytes
+        stm_write( d, d->ptr, buf[ i ] );
+        if ( !( d->boot && ( d->ptr == BOOT_REG_DATA ) ) ) d->ptr++;
+    }
+}
+
+
+static void sim_dev_read( sim_device_t *d, uint8_t *buf, int len )
+{
+    uint16_t v = 0;
+    int i;
+
+    for ( i = 0; i < len; i++ )
+    {
+        if ( d->type == SIM_INA219 )
+        {
+            if ( ( i & 1 ) == 0 ) v = ina_read( d, d->ptr );
+            buf[ i ] = ( i & 1 ) ? ( v & 0xFF ) : ( v >> 8 );
+        }
+        else
+        {
+            buf[ i ] = stm_read( d, d->ptr++ );
+        }
+    }
+}
+
+
+static sim_fd_t *sim_fd( int fd )
+{
+    if ( ( fd < 0 ) || ( fd >= SIM_FDS ) || !sim_fds[ fd ].used )
+    {
+        errno = EBADF;
+        return NULL;
+    }
+
+    return &sim_fds[ fd ];
+}
+
+
+// The device at address if it ACKs, called with sim_lock held
+static sim_device_t *sim_find( int bus, int address )
+{
+    sim_device_t *d = ( ( address >= 0 ) && ( address < 128 ) ) ? sim_devices[ bus ][ address ] : NULL;
+
+    if ( ( d != NULL ) && d->restart_at && ( sim_now() >= d->restart_at ) )
+    {
+        d->restart_at = 0;
+        stm_restart( d, d->restart_boot );
+    }
+
+    if ( ( d == NULL ) || ( sim_now() < d->offline_until ) )
+    {
+        errno = ENXIO;
+        return NULL;
+    }
+
+    if ( sim_chance( sim_nak ) )
+    {
+        sim_stats.faults++;
+        errno = EREMOTEIO;
+        return NULL;
+    }
+
+    return d;
+}
+
+
+static int sim_open( int bus )
+{
+    int fd;
+
+    if ( ( bus < 0 ) || ( bus >= SIM_BUSES ) )
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock( &sim_lock );
+    sim_setup();
+    sim_stats.syscalls++;
+    sim_bus_setup( bus );
+    for ( fd = 0; ( fd < SIM_FDS ) && sim_fds[ fd ].used; fd++ )
+        ;
+    if ( fd < SIM_FDS )
+    {
+        sim_fds[ fd ].used = 1;
+        sim_fds[ fd ].bus = bus;
+        sim_fds[ fd ].slave = -1;
+    }
+    pthread_mutex_unlock( &sim_lock );
+
+    if ( fd == SIM_FDS )
+    {
+        errno = EMFILE;
+        return -1;
+    }
+    return fd;
+}
+
+
+static int sim_close( int fd )
+{
+    sim_fd_t *f;
+
+    pthread_mutex_lock( &sim_lock );
+    sim_stats.syscalls++;
+    f = sim_fd( fd );
+    if ( f != NULL ) f->used = 0;
+    pthread_mutex_unlock( &sim_lock );
+
+    return ( f != NULL ) ? 0 : -1;
+}
+
+
+static int sim_read( int fd, void *buf, int len )
+{
+    sim_device_t *d = NULL;
+    sim_fd_t *f;
+
+    pthread_mutex_lock( &sim_lock );
+    sim_stats.syscalls++;
+    if ( ( f = sim_fd( fd ) ) != NULL ) d = sim_find( f->bus, f->slave );
+    if ( d != NULL ) sim_dev_read( d, buf, len );
+    pthread_mutex_unlock( &sim_lock );
+
+    if ( f == NULL )
+        return -1;
+
+    sim_wire( 1, ( d != NULL ) ? len : 0 );
+    return ( d != NULL ) ? len : -1;
+}
+
+
+static int sim_write( int fd, const void *buf, int len )
+{
+    sim_device_t *d = NULL;
+    sim_fd_t *f;
+
+    pthread_mutex_lock( &sim_lock );
+    sim_stats.syscalls++;
+    if ( ( f = sim_fd( fd ) ) != NULL ) d = sim_find( f->bus, f->slave );
+    if ( d != NULL ) sim_dev_write( d, buf, len );
+    pthread_mutex_unlock( &sim_lock );
+
+    if ( f == NULL )
+        return -1;
+
+    sim_wire( 1, ( d != NULL ) ? len : 0 );
+    return ( d != NULL ) ? len : -1;
+}
+
+
+static int sim_transfer( sim_fd_t *f, struct i2c_rdwr_ioctl_data *xfer )
+{
+    sim_device_t *d;
+    unsigned int i;
+    int bytes = 0;
+    int rc = xfer->nmsgs;
+
+    pthread_mutex_lock( &sim_lock );
+    for ( i = 0; i < xfer->nmsgs; i++ )
+    {
+        struct i2c_msg *msg = &xfer->msgs[ i ];
+
+        // A NAK ends the transaction at the message that got it
+        if ( ( d = sim_find( f->bus, msg->addr ) ) == NULL )
+        {
+            rc = -1;
+            i++;
+            break;
+        }
+        if ( msg->flags & I2C_M_RD ) sim_dev_read( d, msg->buf, msg->len );
+        else sim_dev_write( d, msg->buf, msg->len );
+        bytes += msg->len;
+    }
+    pthread_mutex_unlock( &sim_lock );
+
+    sim_wire( i, bytes );
+    return rc;
+}
+
+
+static int sim_smbus( sim_fd_t *f, struct i2c_smbus_ioctl_data *args )
+{
+    sim_device_t *d;
+    int len;
+
+    if ( ( args->read_write != I2C_SMBUS_READ ) || ( args->size != I2C_SMBUS_I2C_BLOCK_DATA ) )
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    len = args->data->block[ 0 ];
+    if ( ( len < 1 ) || ( len > I2C_SMBUS_BLOCK_MAX ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock( &sim_lock );
+    d = sim_find( f->bus, f->slave );
+    if ( d != NULL )
+    {
+        d->ptr = args->command;
+        sim_dev_read( d, &args->data->block[ 1 ], len );
+    }
+    pthread_mutex_unlock( &sim_lock );
+
+    sim_wire( 2, ( d != NULL ) ? len + 1 : 0 );
+    return ( d != NULL ) ? 0 : -1;
+}
+
+
+static int sim_ioctl( int fd, unsigned long request, void *arg )
+{
+    sim_fd_t *f;
+
+    pthread_mutex_lock( &sim_lock );
+    sim_stats.syscalls++;
+    f = sim_fd( fd );
+    pthread_mutex_unlock( &sim_lock );
+
+    if ( f == NULL )
+        return -1;
+
+    switch ( request )
+    {
+        case I2C_FUNCS:
+        {
+            *(unsigned long *)arg = I2C_FUNC_I2C | I2C_FUNC_SMBUS_READ_I2C_BLOCK;
+            return 0;
+        }
+        case I2C_SLAVE:
+        case I2C_SLAVE_FORCE:
+        {
+            if ( ( (long)arg < 0 ) || ( (long)arg > 127 ) )
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            f->slave = (int)(long)arg;
+            return 0;
+        }
+        case I2C_RDWR:
+        {
+            return sim_transfer( f, arg );
+        }
+        case I2C_SMBUS:
+        {
+            return sim_smbus( f, arg );
+        }
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+
+const pu_transport_t pu_sim_transport = {
+    "sim", sim_open, sim_close, sim_ioctl, sim_read, sim_write
+};
@@ -0,0 +1,1183 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "powerutils.h"
+
+#define DATA_READ_PASSES    5
+#define CMD_SPIN_READS      8           // tight polls before backing off
+#define CMD_BACKOFF_MIN_US  100
+#define CMD_BACKOFF_MAX_US  10000
+
+#define INA219_BUS_REG      2
+#define INA219_POWER_REG    3
+#define INA219_CURRENT_REG  4
+
+struct pu_bus
+{
+    const pu_transport_t *transport;
+    int             number;
+    int             fd;
+    int             refs;
+    int             rdwr;               // adapter takes combined I2C_RDWR transfers
+    int             smbus_block;        // adapter offers SMBus I2C block reads
+    int             slave;              // address last set with I2C_SLAVE
+    unsigned char   pointer[ 128 ];     // register pointer per address, for tracing
+    pthread_mutex_t lock;               // one transfer at a time
+    pthread_mutex_t address_lock[ 128 ];
+    int             lock_depth[ 128 ];  // pu_lock() nesting per address
+    int             lock_fd[ 128 ];     // flock()ed against other processes, -1 not yet open, -2 off, -3 failed
+    struct pu_bus  *next;
+};
+
+static pu_bus_t *bus_list = NULL;
+static pthread_mutex_t bus_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static int legacy_mode = 0;
+static const pu_transport_t *transport = NULL;
+
+typedef struct
+{
+    int             fd;
+    int             size;
+    int             count;
+    pthread_mutex_t lock;
+    pu_trace_rec_t  rec[];
+} trace_ring_t;
+
+static trace_ring_t *trace = NULL;      // only looked at further when tracing
+static int trace_checked = 0;
+
+
+static int i2cdev_open( int bus )
+{
+    char filename[ 20 ];
+
+    snprintf( filename, 19, "/dev/i2c-%d", bus );
+    return open( filename, O_RDWR );
+}
+
+
+static int i2cdev_close( int fd )
+{
+    return close( fd );
+}
+
+
+static int i2cdev_ioctl( int fd, unsigned long request, void *arg )
+{
+    return ioctl( fd, request, arg );
+}
+
+
+static int i2cdev_read( int fd, void *buf, int len )
+{
+    return read( fd, buf, len );
+}
+
+
+static int i2cdev_write( int fd, const void *buf, int len )
+{
+    return write( fd, buf, len );
+}
+
+
+const pu_transport_t pu_i2cdev_transport = {
+    "i2c-dev", i2cdev_open, i2cdev_close, i2cdev_ioctl, i2cdev_read, i2cdev_write
+};
+
+
+unsigned int pu_monotonic_us( void )
+{
+    struct timespec ts;
+
+    // Widen first, tv_sec * 1000000 overflows a 32-bit time_t in 35 minutes
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( unsigned int )( ( unsigned long long )ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+
+static unsigned long long monotonic_ns( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( unsigned long long )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Called with the ring locked
+static void trace_flush( trace_ring_t *t )
+{
+    if ( t->count > 0 )
+    {
+        if ( write( t->fd, t->rec, t->count * sizeof( pu_trace_rec_t ) ) < 0 )
+        {
+            // Nothing to report it to, the trace is just short
+        }
+        t->count = 0;
+    }
+}
+
+
+static pu_trace_rec_t *trace_next( trace_ring_t *t )
+{
+    pu_trace_rec_t *r;
+
+    if ( t->count == t->size )
+    {
+        trace_flush( t );
+    }
+    r = &t->rec[ t->count++ ];
+    memset( r, 0, sizeof( *r ) );
+    return r;
+}
+
+
+// One record per message, the transaction's time split evenly between
+// them.  Called once the transfer is done, with the bus still locked.
+static void trace_transfer( pu_dev_t *dev, const struct i2c_msg *msgs, int count, unsigned long long start, int errnum )
+{
+    trace_ring_t *t = trace;
+    unsigned long long elapsed = monotonic_ns() - start;
+    unsigned int share = ( elapsed / count > 0xFFFFFFFF ) ? 0xFFFFFFFF : elapsed / count;
+    unsigned char *pointer;
+    pu_trace_rec_t *r;
+    int i, j, skip;
+
+    pthread_mutex_lock( &t->lock );
+    for ( i = 0; i < count; i++ )
+    {
+        pointer = &dev->bus->pointer[ msgs[ i ].addr & 0x7F ];
+        r = trace_next( t );
+        r->start_ns = start + ( unsigned long long )share * i;
+        r->duration_ns = share;
+        r->bus = dev->bus->number;
+        r->address = msgs[ i ].addr;
+        r->errnum = errnum;
+
+        if ( msgs[ i ].flags & I2C_M_RD )
+        {
+            r->type = PU_TRACE_READ;
+            r->reg = *pointer;
+            r->len = msgs[ i ].len;
+            skip = 0;
+        }
+        else
+        {
+            r->type = PU_TRACE_WRITE;
+            r->reg = *pointer = msgs[ i ].buf[ 0 ];
+            r->len = msgs[ i ].len - 1;
+            skip = 1;
+        }
+        if ( i > 0 ) r->type |= PU_TRACE_CONTINUED;
+
+        for ( j = 0; ( j < r->len ) && ( j < 4 ); j++ )
+        {
+            r->data |= msgs[ i ].buf[ skip + j ] << ( 8 * j );
+        }
+    }
+    pthread_mutex_unlock( &t->lock );
+}
+
+
+static void trace_rw( pu_dev_t *dev, int read, void *buf, int len, unsigned long long start, int rc )
+{
+    struct i2c_msg msg = {
+        .addr = dev->address, .flags = read ? I2C_M_RD : 0, .len = len, .buf = buf
+    };
+
+    trace_transfer( dev, &msg, 1, start, ( rc == PU_OK ) ? 0 : dev->errnum );
+}
+
+
+// Commands and sleeps, dev is NULL for sleeps not on behalf of a device
+static void trace_event( pu_dev_t *dev, int type, unsigned long long start, unsigned char reg, unsigned char status )
+{
+    trace_ring_t *t = trace;
+    unsigned long long elapsed = monotonic_ns() - start;
+    pu_trace_rec_t *r;
+
+    pthread_mutex_lock( &t->lock );
+    r = trace_next( t );
+    r->start_ns = start;
+    r->duration_ns = ( elapsed > 0xFFFFFFFF ) ? 0xFFFFFFFF : elapsed;
+    r->type = type;
+    r->bus = dev ? dev->bus->number : 0xFF;
+    r->address = dev ? dev->address : 0xFF;
+    r->reg = reg;
+    r->status = status;
+    pthread_mutex_unlock( &t->lock );
+}
+
+
+static void dev_sleep( pu_dev_t *dev, unsigned int us )
+{
+    unsigned long long start = trace ? monotonic_ns() : 0;
+
+    usleep( us );
+    if ( trace != NULL ) trace_event( dev, PU_TRACE_SLEEP, start, 0, 0 );
+}
+
+
+void pu_sleep_us( unsigned int us )
+{
+    dev_sleep( NULL, us );
+}
+
+
+int pu_trace_start( const char *path, int entries )
+{
+    static int registered = 0;
+    pu_trace_header_t h;
+    struct timespec ts;
+    trace_ring_t *t;
+    int fd;
+
+    if ( trace != NULL )
+        return PU_ERR_ARG;
+
+    if ( entries <= 0 )
+    {
+        entries = PU_TRACE_ENTRIES;
+    }
+
+    fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 )
+        return PU_ERR_OPEN;
+
+    t = calloc( 1, sizeof( *t ) + entries * sizeof( pu_trace_rec_t ) );
+    if ( t == NULL )
+    {
+        close( fd );
+        return PU_ERR_NOMEM;
+    }
+
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, PU_TRACE_MAGIC, 4 );
+    h.version = PU_TRACE_VERSION;
+    h.record_size = sizeof( pu_trace_rec_t );
+    h.monotonic_ns = monotonic_ns();
+    clock_gettime( CLOCK_REALTIME, &ts );
+    h.realtime_ns = ( unsigned long long )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    if ( write( fd, &h, sizeof( h ) ) != sizeof( h ) )
+    {
+        close( fd );
+        free( t );
+        return PU_ERR_IO;
+    }
+
+    t->fd = fd;
+    t->size = entries;
+    pthread_mutex_init( &t->lock, NULL );
+    trace = t;
+
+    if ( !registered )
+    {
+        registered = 1;
+        atexit( pu_trace_stop );
+    }
+    return PU_OK;
+}
+
+
+void pu_trace_stop( void )
+{
+    trace_ring_t *t = trace;
+
+    if ( t == NULL )
+        return;
+
+    pthread_mutex_lock( &t->lock );
+    trace = NULL;
+    trace_flush( t );
+    pthread_mutex_unlock( &t->lock );
+
+    close( t->fd );
+    pthread_mutex_destroy( &t->lock );
+    free( t );
+}
+
+
+const char *pu_strerror( int err )
+{
+    switch ( err )
+    {
+        case PU_OK:             return "Success";
+        case PU_ERR_OPEN:       return "Error opening I2C bus";
+        case PU_ERR_ADDRESS:    return "Error setting I2C address";
+        case PU_ERR_IO:         return "I2C transfer failed";
+        case PU_ERR_NODEV:      return "No board found";
+        case PU_ERR_TIMEOUT:    return "Command timed out";
+        case PU_ERR_COMMAND:    return "Command error";
+        case PU_ERR_UNSTABLE:   return "Command data unstable";
+        case PU_ERR_ARG:        return "Invalid argument";
+        case PU_ERR_NOMEM:      return "Out of memory";
+        default:                return "Unknown error";
+    }
+}
+
+
+void pu_set_legacy( int legacy )
+{
+    legacy_mode = legacy;
+}
+
+
+void pu_set_transport( const pu_transport_t *t )
+{
+    transport = t;
+}
+
+
+// Without an explicit choice PU_TRANSPORT=sim swaps in the simulator and
+// replay a recorded session, so the tools can be run and benchmarked
+// without hardware, and PU_RECORD=<file> records whatever is used
+const pu_transport_t *pu_get_transport( void )
+{
+    const pu_transport_t *recorder;
+    const char *name;
+
+    if ( transport == NULL )
+    {
+        name = getenv( "PU_TRANSPORT" );
+        if ( ( name != NULL ) && ( strcmp( name, "sim" ) == 0 ) ) transport = &pu_sim_transport;
+        else if ( ( name != NULL ) && ( strcmp( name, "replay" ) == 0 ) ) transport = &pu_replay_transport;
+        else transport = &pu_i2cdev_transport;
+
+        name = getenv( "PU_RECORD" );
+        if ( ( name != NULL ) && ( transport != &pu_replay_transport ) &&
+             ( ( recorder = pu_record( transport, name ) ) != NULL ) )
+        {
+            transport = recorder;
+        }
+    }
+
+    return transport;
+}
+
+
+// Find the bus in the shared list or open it and work out which transfer
+// types its adapter supports.  Called with bus_list_lock held.
+static pu_bus_t *bus_get( int number, int *errnum )
+{
+    pthread_mutexattr_t attr;
+    unsigned long funcs = 0;
+    pu_bus_t *bus;
+    int i;
+
+    for ( bus = bus_list; bus != NULL; bus = bus->next )
+    {
+        if ( bus->number == number )
+        {
+            bus->refs++;
+            return bus;
+        }
+    }
+
+    if ( !trace_checked )
+    {
+        const char *path = getenv( "PU_TRACE" );
+
+        trace_checked = 1;
+        if ( path != NULL ) pu_trace_start( path, 0 );
+    }
+
+    bus = calloc( 1, sizeof( *bus ) );
+    if ( bus == NULL )
+    {
+        *errnum = ENOMEM;
+        return NULL;
+    }
+
+    bus->transport = pu_get_transport();
+    bus->fd = bus->transport->open( number );
+    if ( bus->fd < 0 )
+    {
+        *errnum = errno;
+        free( bus );
+        return NULL;
+    }
+
+    // Fall back to plain read/write on adapters without I2C_RDWR support
+    if ( bus->transport->ioctl( bus->fd, I2C_FUNCS, &funcs ) < 0 )
+    {
+        funcs = 0;
+    }
+    bus->rdwr = ( !legacy_mode && ( funcs & I2C_FUNC_I2C ) ) ? 1 : 0;
+    bus->smbus_block = ( !legacy_mode && ( funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK ) ) ? 1 : 0;
+    bus->number = number;
+    bus->slave = -1;
+    bus->refs = 1;
+
+    pthread_mutex_init( &bus->lock, NULL );
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+    for ( i = 0; i < 128; i++ )
+    {
+        pthread_mutex_init( &bus->address_lock[ i ], &attr );
+        bus->lock_fd[ i ] = -1;
+    }
+    pthread_mutexattr_destroy( &attr );
+
+    bus->next = bus_list;
+    bus_list = bus;
+    return bus;
+}
+
+
+static void bus_put( pu_bus_t *bus )
+{
+    pu_bus_t **p;
+    int i;
+
+    if ( --bus->refs > 0 )
+        return;
+
+    for ( p = &bus_list; *p != NULL; p = &( *p )->next )
+    {
+        if ( *p == bus )
+        {
+            *p = bus->next;
+            break;
+        }
+    }
+
+    bus->transport->close( bus->fd );
+    pthread_mutex_destroy( &bus->lock );
+    for ( i = 0; i < 128; i++ )
+    {
+        pthread_mutex_destroy( &bus->address_lock[ i ] );
+        if ( bus->lock_fd[ i ] >= 0 ) close( bus->lock_fd[ i ] );
+    }
+    free( bus );
+}
+
+
+// Plain read()/write() and SMBus calls go to the I2C_SLAVE address, which
+// is shared by every device on the descriptor.  Called with the bus locked.
+static int dev_select( pu_dev_t *dev )
+{
+    if ( dev->bus->slave != dev->address )
+    {
+        if ( dev->bus->transport->ioctl( dev->bus->fd, I2C_SLAVE, (void *)(long)dev->address ) < 0 )
+        {
+            dev->errnum = errno;
+            dev->bus->slave = -1;
+            return PU_ERR_ADDRESS;
+        }
+        dev->bus->slave = dev->address;
+    }
+
+    return PU_OK;
+}
+
+
+static int dev_read( pu_dev_t *dev, void *buf, int len )
+{
+    unsigned long long start = trace ? monotonic_ns() : 0;
+    int rc = dev_select( dev );
+
+    if ( rc == PU_OK )
+    {
+        dev->transfers++;
+        if ( dev->bus->transport->read( dev->bus->fd, buf, len ) != len )
+        {
+            dev->errnum = errno;
+            rc = PU_ERR_IO;
+        }
+        if ( trace != NULL ) trace_rw( dev, 1, buf, len, start, rc );
+    }
+
+    return rc;
+}
+
+
+static int dev_write( pu_dev_t *dev, const void *buf, int len )
+{
+    unsigned long long start = trace ? monotonic_ns() : 0;
+    int rc = dev_select( dev );
+
+    if ( rc == PU_OK )
+    {
+        dev->transfers++;
+        if ( dev->bus->transport->write( dev->bus->fd, buf, len ) != len )
+        {
+            dev->errnum = errno;
+            rc = PU_ERR_IO;
+        }
+        if ( trace != NULL ) trace_rw( dev, 0, (void *)buf, len, start, rc );
+    }
+
+    return rc;
+}
+
+
+// Issue messages as one combined transaction (repeated start, single STOP)
+static int dev_transfer( pu_dev_t *dev, struct i2c_msg *msgs, int count )
+{
+    struct i2c_rdwr_ioctl_data xfer;
+    unsigned long long start = trace ? monotonic_ns() : 0;
+    int rc = PU_OK;
+
+    xfer.msgs = msgs;
+    xfer.nmsgs = count;
+    dev->transfers++;
+
+    if ( dev->bus->transport->ioctl( dev->bus->fd, I2C_RDWR, &xfer ) != count )
+    {
+        dev->errnum = errno;
+        rc = PU_ERR_IO;
+    }
+    if ( trace != NULL ) trace_transfer( dev, msgs, count, start, ( rc == PU_OK ) ? 0 : dev->errnum );
+
+    return rc;
+}
+
+
+// Point at reg and read len bytes back, as one transaction where possible
+static int dev_pointer_read( pu_dev_t *dev, unsigned char reg, unsigned char *data, int len )
+{
+    int rc;
+
+    if ( dev->bus->rdwr )
+    {
+        struct i2c_msg msgs[ 2 ] = {
+            { .addr = dev->address, .flags = 0,        .len = 1,   .buf = &reg },
+            { .addr = dev->address, .flags = I2C_M_RD, .len = len, .buf = data },
+        };
+
+        return dev_transfer( dev, msgs, 2 );
+    }
+
+    rc = dev_write( dev, &reg, 1 );
+    if ( rc == PU_OK )
+    {
+        rc = dev_read( dev, data, len );
+    }
+
+    return rc;
+}
+
+
+// SMBus I2C block read, for adapters that can't do I2C_RDWR but still
+// keep a block together in one transaction
+static int dev_smbus_read( pu_dev_t *dev, unsigned char reg, unsigned char *data, int len )
+{
+    union i2c_smbus_data block;
+    struct i2c_smbus_ioctl_data args;
+    unsigned long long start = trace ? monotonic_ns() : 0;
+    int rc;
+
+    rc = dev_select( dev );
+    if ( rc != PU_OK )
+        return rc;
+
+    block.block[ 0 ] = len;
+    args.read_write = I2C_SMBUS_READ;
+    args.command = reg;
+    args.size = I2C_SMBUS_I2C_BLOCK_DATA;
+    args.data = &block;
+    dev->transfers++;
+
+    if ( ( dev->bus->transport->ioctl( dev->bus->fd, I2C_SMBUS, &args ) != 0 ) || ( block.block[ 0 ] != len ) )
+    {
+        dev->errnum = errno;
+        rc = PU_ERR_IO;
+    }
+    else
+    {
+        memcpy( data, &block.block[ 1 ], len );
+    }
+
+    if ( trace != NULL )
+    {
+        struct i2c_msg msgs[ 2 ] = {
+            { .addr = dev->address, .flags = 0,        .len = 1,   .buf = &reg },
+            { .addr = dev->address, .flags = I2C_M_RD, .len = len, .buf = data },
+        };
+
+        trace_transfer( dev, msgs, 2, start, ( rc == PU_OK ) ? 0 : dev->errnum );
+    }
+
+    return rc;
+}
+
+
+int pu_open( pu_dev_t *dev, int bus, int address )
+{
+    int rc;
+
+    memset( dev, 0, sizeof( *dev ) );
+    dev->address = address;
+    dev->command_timeout_ms = PU_COMMAND_TIMEOUT_MS;
+
+    if ( ( bus < 0 ) || ( address < 0x03 ) || ( address > 0x77 ) )
+        return PU_ERR_ARG;
+
+    pthread_mutex_lock( &bus_list_lock );
+    dev->bus = bus_get( bus, &dev->errnum );
+    pthread_mutex_unlock( &bus_list_lock );
+
+    if ( dev->bus == NULL )
+        return ( dev->errnum == ENOMEM ) ? PU_ERR_NOMEM : PU_ERR_OPEN;
+
+    // Select the address now so a bad one shows up at open
+    pthread_mutex_lock( &dev->bus->lock );
+    rc = dev_select( dev );
+    pthread_mutex_unlock( &dev->bus->lock );
+
+    if ( rc != PU_OK )
+    {
+        pu_close( dev );
+    }
+
+    return rc;
+}
+
+
+void pu_close( pu_dev_t *dev )
+{
+    if ( dev->bus == NULL )
+        return;
+
+    pthread_mutex_lock( &bus_list_lock );
+    bus_put( dev->bus );
+    pthread_mutex_unlock( &bus_list_lock );
+    dev->bus = NULL;
+}
+
+
+// Lock file shared by every process using this bus and address, -2 when
+// locking across processes is off or -3 when the file can't be opened.
+// flock() only needs the file open for reading, and it's made readable by
+// everyone whatever the umask, so clients running as different users
+// (root from cron, a monitor in the i2c group) still lock each other out.
+static int lock_open( int bus, int address )
+{
+    const char *dir = getenv( "PU_LOCK_DIR" );
+    char path[ 256 ];
+    int fd;
+
+    if ( dir == NULL )
+    {
+        dir = PU_LOCK_DIR;
+    }
+    if ( *dir == '\0' )
+        return -2;
+
+    snprintf( path, sizeof( path ), "%s/powerutils-i2c%d-%02x.lock", dir, bus, address );
+    fd = open( path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644 );
+    if ( fd < 0 )
+        return -3;
+    fchmod( fd, 0644 );
+
+    return fd;
+}
+
+
+// Threads of this process queue on the address mutex, other processes on
+// an flock() of the address's lock file.  Only the outermost lock of a
+// nested sequence takes the file lock, and only it is counted.
+void pu_lock( pu_dev_t *dev )
+{
+    pu_bus_t *bus = dev->bus;
+    int a = dev->address & 0x7F;
+    unsigned int start = 0;
+    int rc;
+
+    if ( pthread_mutex_trylock( &bus->address_lock[ a ] ) != 0 )
+    {
+        start = pu_monotonic_us();
+        pthread_mutex_lock( &bus->address_lock[ a ] );
+    }
+
+    if ( bus->lock_depth[ a ]++ > 0 )
+        return;
+
+    if ( bus->lock_fd[ a ] == -1 )
+    {
+        bus->lock_fd[ a ] = lock_open( bus->number, a );
+    }
+
+    if ( bus->lock_fd[ a ] >= 0 )
+    {
+        rc = flock( bus->lock_fd[ a ], LOCK_EX | LOCK_NB );
+        if ( ( rc != 0 ) && ( errno == EWOULDBLOCK ) )
+        {
+            if ( start == 0 ) start = pu_monotonic_us();
+            while ( ( ( rc = flock( bus->lock_fd[ a ], LOCK_EX ) ) != 0 ) && ( errno == EINTR ) )
+                ;
+        }
+
+        // Any other failure leaves this sequence unprotected; give up on
+        // the file so it and every later one are counted as unshared
+        if ( rc != 0 )
+        {
+            close( bus->lock_fd[ a ] );
+            bus->lock_fd[ a ] = -3;
+        }
+    }
+
+    dev->locks++;
+    if ( bus->lock_fd[ a ] == -3 )
+    {
+        dev->lock_unshared++;
+    }
+    if ( start != 0 )
+    {
+        dev->lock_contended++;
+        dev->lock_wait_us += pu_monotonic_us() - start;
+    }
+}
+
+
+void pu_unlock( pu_dev_t *dev )
+{
+    pu_bus_t *bus = dev->bus;
+    int a = dev->address & 0x7F;
+
+    if ( ( --bus->lock_depth[ a ] == 0 ) && ( bus->lock_fd[ a ] >= 0 ) )
+    {
+        flock( bus->lock_fd[ a ], LOCK_UN );
+    }
+    pthread_mutex_unlock( &bus->address_lock[ a ] );
+}
+
+
+int pu_reg8_read( pu_dev_t *dev, unsigned char reg, unsigned char *data )
+{
+    int rc;
+
+    pthread_mutex_lock( &dev->bus->lock );
+    rc = dev_pointer_read( dev, reg, data, 1 );
+    pthread_mutex_unlock( &dev->bus->lock );
+
+    return rc;
+}
+
+
+// Read several (not necessarily adjacent) registers, batching as many
+// pointer/data pairs as the adapter accepts into each I2C_RDWR call
+int pu_reg8_read_multi( pu_dev_t *dev, const unsigned char *regs, unsigned char *data, int count )
+{
+    struct i2c_msg msgs[ I2C_RDWR_IOCTL_MAX_MSGS ];
+    unsigned char ptrs[ I2C_RDWR_IOCTL_MAX_MSGS / 2 ];
+    int i, n, rc = PU_OK;
+
+    pthread_mutex_lock( &dev->bus->lock );
+
+    while ( ( rc == PU_OK ) && ( count > 0 ) )
+    {
+        if ( !dev->bus->rdwr )
+        {
+            rc = dev_pointer_read( dev, *regs++, data++, 1 );
+            count--;
+            continue;
+        }
+
+        n = ( count < I2C_RDWR_IOCTL_MAX_MSGS / 2 ) ? count : I2C_RDWR_IOCTL_MAX_MSGS / 2;
+
+        for ( i = 0; i < n; i++ )
+        {
+            ptrs[ i ] = regs[ i ];
+            msgs[ i*2 ].addr = dev->address;
+            msgs[ i*2 ].flags = 0;
+            msgs[ i*2 ].len = 1;
+            msgs[ i*2 ].buf = &ptrs[ i ];
+            msgs[ i*2+1 ].addr = dev->address;
+            msgs[ i*2+1 ].flags = I2C_M_RD;
+            msgs[ i*2+1 ].len = 1;
+            msgs[ i*2+1 ].buf = &data[ i ];
+        }
+
+        rc = dev_transfer( dev, msgs, n*2 );
+
+        regs += n;
+        data += n;
+        count -= n;
+    }
+
+    pthread_mutex_unlock( &dev->bus->lock );
+    return rc;
+}
+
+
+int pu_reg8_block_read( pu_dev_t *dev, unsigned char reg, unsigned char *data, int len )
+{
+    int rc;
+
+    if ( ( len < 1 ) || ( len > 255 ) )
+        return PU_ERR_ARG;
+
+    pthread_mutex_lock( &dev->bus->lock );
+    if ( !dev->bus->rdwr && dev->bus->smbus_block && ( len <= I2C_SMBUS_BLOCK_MAX ) )
+        rc = dev_smbus_read( dev, reg, data, len );
+    else
+        rc = dev_pointer_read( dev, reg, data, len );
+    pthread_mutex_unlock( &dev->bus->lock );
+
+    return rc;
+}
+
+
+int pu_reg8_write( pu_dev_t *dev, unsigned char reg, unsigned char data )
+{
+    unsigned char bite[ 2 ];
+    int rc;
+
+    bite[ 0 ] = reg;
+    bite[ 1 ] = data;
+
+    pthread_mutex_lock( &dev->bus->lock );
+    rc = dev_write( dev, bite, 2 );
+    pthread_mutex_unlock( &dev->bus->lock );
+
+    return rc;
+}
+
+
+int pu_reg8_block_write( pu_dev_t *dev, unsigned char reg, const unsigned char *data, int len )
+{
+    unsigned char bites[ I2C_SMBUS_BLOCK_MAX + 1 ];
+    int rc;
+
+    if ( ( len < 1 ) || ( len > I2C_SMBUS_BLOCK_MAX ) )
+        return PU_ERR_ARG;
+
+    bites[ 0 ] = reg;
+    memcpy( &bites[ 1 ], data, len );
+
+    pthread_mutex_lock( &dev->bus->lock );
+    rc = dev_write( dev, bites, len + 1 );
+    pthread_mutex_unlock( &dev->bus->lock );
+
+    return rc;
+}
+
+
+int pu_reg16_read( pu_dev_t *dev, unsigned char reg, unsigned short *data )
+{
+    unsigned char bite[ 2 ];
+    int rc;
+
+    pthread_mutex_lock( &dev->bus->lock );
+    rc = dev_pointer_read( dev, reg, bite, 2 );
+    pthread_mutex_unlock( &dev->bus->lock );
+
+    if ( rc == PU_OK )
+    {
+        *data = ( bite[ 0 ] << 8 ) | bite[ 1 ];
+    }
+
+    return rc;
+}
+
+
+int pu_reg16_read_multi( pu_dev_t *dev, const unsigned char *regs, unsigned short *data, int count )
+{
+    struct i2c_msg msgs[ I2C_RDWR_IOCTL_MAX_MSGS ];
+    unsigned char bites[ I2C_RDWR_IOCTL_MAX_MSGS / 2 ][ 3 ];
+    int i, n, rc = PU_OK;
+
+    if ( !dev->bus->rdwr )
+    {
+        for ( i = 0; ( rc == PU_OK ) && ( i < count ); i++ )
+        {
+            rc = pu_reg16_read( dev, regs[ i ], &data[ i ] );
+        }
+        return rc;
+    }
+
+    pthread_mutex_lock( &dev->bus->lock );
+
+    while ( ( rc == PU_OK ) && ( count > 0 ) )
+    {
+        n = ( count < I2C_RDWR_IOCTL_MAX_MSGS / 2 ) ? count : I2C_RDWR_IOCTL_MAX_MSGS / 2;
+
+        for ( i = 0; i < n; i++ )
+        {
+            bites[ i ][ 0 ] = regs[ i ];
+            msgs[ i*2 ].addr = dev->address;
+            msgs[ i*2 ].flags = 0;
+            msgs[ i*2 ].len = 1;
+            msgs[ i*2 ].buf = &bites[ i ][ 0 ];
+            msgs[ i*2+1 ].addr = dev->address;
+            msgs[ i*2+1 ].flags = I2C_M_RD;
+            msgs[ i*2+1 ].len = 2;
+            msgs[ i*2+1 ].buf = &bites[ i ][ 1 ];
+        }
+
+        rc = dev_transfer( dev, msgs, n*2 );
+        if ( rc != PU_OK )
+            break;
+
+        for ( i = 0; i < n; i++ )
+        {
+            data[ i ] = ( bites[ i ][ 1 ] << 8 ) | bites[ i ][ 2 ];
+        }
+
+        regs += n;
+        data += n;
+        count -= n;
+    }
+
+    pthread_mutex_unlock( &dev->bus->lock );
+    return rc;
+}
+
+
+int pu_reg16_write( pu_dev_t *dev, unsigned char reg, unsigned short data )
+{
+    unsigned char bite[ 3 ];
+    int rc;
+
+    bite[ 0 ] = reg;
+    bite[ 1 ] = ( data >> 8 ) & 0xFF;
+    bite[ 2 ] = ( data & 0xFF );
+
+    pthread_mutex_lock( &dev->bus->lock );
+    rc = dev_write( dev, bite, 3 );
+    pthread_mutex_unlock( &dev->bus->lock );
+
+    return rc;
+}
+
+
+int pu_stm_verify( pu_dev_t *dev )
+{
+    unsigned char c;
+    int rc;
+
+    rc = pu_reg8_read( dev, REG_ID, &c );
+    if ( ( rc == PU_OK ) && ( c != 0xED ) )
+    {
+        rc = PU_ERR_NODEV;
+    }
+
+    return rc;
+}
+
+
+// Read the whole register map, REG_ID through REG_END, as one sequential
+// block.  If the block doesn't come back framed by the ID and end markers
+// (some adapters mangle long reads) fall back to batched register reads.
+int pu_stm_snapshot( pu_dev_t *dev, unsigned char *map )
+{
+    unsigned char regs[ NUM_REGISTERS ];
+    int i;
+
+    if ( ( pu_reg8_block_read( dev, REG_ID, map, NUM_REGISTERS ) == PU_OK ) &&
+         ( map[ REG_ID ] == 0xED ) && ( map[ REG_END ] == 0xEE ) )
+    {
+        return PU_OK;
+    }
+
+    for ( i = 0; i < NUM_REGISTERS; i++ )
+    {
+        regs[ i ] = i;
+    }
+
+    return pu_reg8_read_multi( dev, regs, map, NUM_REGISTERS );
+}
+
+
+// Read REG_DATA_0..3 as one block so the controller can't update the
+// value part way through.  Some adapters (the Pi's among them) return
+// garbage from block reads while reporting success, so the block is read
+// twice and only trusted if both agree.  Otherwise, or without block
+// reads, the bytes are read one at a time and may straddle an update, so
+// re-read until two passes agree.
+int pu_stm_data32_read( pu_dev_t *dev, unsigned int *data )
+{
+    static const unsigned char regs[ 4 ] = { REG_DATA_3, REG_DATA_2, REG_DATA_1, REG_DATA_0 };
+    unsigned char bites[ 4 ], check[ 4 ];
+    unsigned int last = 0;
+    int i, pass, rc;
+
+    if ( dev->bus->rdwr || dev->bus->smbus_block )
+    {
+        if ( ( pu_reg8_block_read( dev, REG_DATA_0, bites, 4 ) == PU_OK ) &&
+             ( pu_reg8_block_read( dev, REG_DATA_0, check, 4 ) == PU_OK ) )
+        {
+            if ( memcmp( bites, check, 4 ) == 0 )
+            {
+                *data = bites[ 0 ] | ( bites[ 1 ] << 8 ) | ( bites[ 2 ] << 16 ) | ( (unsigned int)bites[ 3 ] << 24 );
+                return PU_OK;
+            }
+            dev->tears++;
+        }
+    }
+
+    for ( pass = 0; pass < DATA_READ_PASSES; pass++ )
+    {
+        rc = pu_reg8_read_multi( dev, regs, bites, 4 );
+        if ( rc != PU_OK )
+            return rc;
+
+        *data = 0;
+        for ( i = 0; i < 4; i++ )
+        {
+            *data <<= 8;
+            *data |= bites[ i ];
+        }
+
+        if ( pass > 0 )
+        {
+            if ( *data == last )
+                return PU_OK;
+            dev->tears++;
+        }
+        last = *data;
+    }
+
+    return PU_ERR_UNSTABLE;
+}
+
+
+int pu_stm_data32_write( pu_dev_t *dev, unsigned int data )
+{
+    int i, rc = PU_OK;
+
+    for ( i = 0; ( rc == PU_OK ) && ( i < 4 ); i++ )
+    {
+        rc = pu_reg8_write( dev, REG_DATA_0 + i, data & 0xFF );
+        data >>= 8;
+    }
+
+    return rc;
+}
+
+
+// Most commands finish within a few bus transactions, so poll tightly at
+// first, then back off exponentially until the command clears or times
+// out.  The address stays locked throughout but the bus is free between
+// polls for other devices on it.
+int pu_stm_command( pu_dev_t *dev, unsigned char command )
+{
+    unsigned char r = 0xEE;
+    unsigned int start, elapsed = 0;
+    unsigned long long traced = trace ? monotonic_ns() : 0;
+    int polls = 0;
+    int delay = CMD_BACKOFF_MIN_US;
+    int rc;
+
+    pu_lock( dev );
+
+    rc = pu_reg8_write( dev, REG_COMMAND, command );
+    if ( rc == PU_OK )
+    {
+        start = pu_monotonic_us();
+        do {
+            if ( polls++ >= CMD_SPIN_READS )
+            {
+                dev_sleep( dev, delay );
+                delay *= 2;
+                if ( delay > CMD_BACKOFF_MAX_US ) delay = CMD_BACKOFF_MAX_US;
+            }
+            rc = pu_reg8_read( dev, REG_COMMAND, &r );
+            if ( rc != PU_OK )
+                break;
+            elapsed = pu_monotonic_us() - start;
+        } while ( ( r == command ) && ( elapsed < dev->command_timeout_ms * 1000u ) );
+
+        dev->command_us = elapsed;
+        if ( rc == PU_OK )
+        {
+            if ( r == command ) rc = PU_ERR_TIMEOUT;
+            else if ( r != 0 ) rc = PU_ERR_COMMAND;
+        }
+    }
+    dev->command_status = r;
+    if ( trace != NULL ) trace_event( dev, PU_TRACE_COMMAND, traced, command, r );
+
+    pu_unlock( dev );
+    return rc;
+}
+
+
+int pu_stm_read8( pu_dev_t *dev, unsigned char command, unsigned char *data )
+{
+    int rc;
+
+    pu_lock( dev );
+    rc = pu_stm_command( dev, command );
+    if ( rc == PU_OK )
+    {
+        rc = pu_reg8_read( dev, REG_DATA_0, data );
+    }
+    pu_unlock( dev );
+
+    return rc;
+}
+
+
+int pu_stm_read32( pu_dev_t *dev, unsigned char command, unsigned int *data )
+{
+    int rc;
+
+    pu_lock( dev );
+    rc = pu_stm_command( dev, command );
+    if ( rc == PU_OK )
+    {
+        rc = pu_stm_data32_read( dev, data );
+    }
+    pu_unlock( dev );
+
+    return rc;
+}
+
+
+int pu_stm_write32( pu_dev_t *dev, unsigned char command, unsigned int data )
+{
+    int rc;
+
+    pu_lock( dev );
+    rc = pu_stm_data32_write( dev, data );
+    if ( rc == PU_OK )
+    {
+        rc = pu_stm_command( dev, command );
+    }
+    pu_unlock( dev );
+
+    return rc;
+}
+
+
+int pu_stm_read_rtc( pu_dev_t *dev, unsigned int *seconds )
+{
+    return pu_stm_read32( dev, COMMAND_READ_COUNT, seconds );
+}
+
+
+int pu_ina219_read( pu_dev_t *dev, double current_lsb, float *mv, float *ma, float *mw )
+{
+    static const unsigned char regs[ 3 ] = { INA219_BUS_REG, INA219_CURRENT_REG, INA219_POWER_REG };
+    unsigned short data[ 3 ];
+    int rc;
+
+    rc = pu_reg16_read_multi( dev, regs, data, 3 );
+    if ( rc == PU_OK )
+    {
+        if ( mv != NULL ) *mv = ( float )( ( data[ 0 ] & 0xFFF8 ) >> 1 );
+        if ( ma != NULL ) *ma = ( float )( (short)data[ 1 ] * current_lsb );
+        if ( mw != NULL )
+        {
+            // POWER_REG is unsigned, follow the current's direction
+            *mw = ( float )( data[ 2 ] * current_lsb * 20 );
+            if ( (short)data[ 1 ] < 0 ) *mw = -*mw;
+        }
+    }
+
+    return rc;
+}
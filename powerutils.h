@@ -0,0 +1,180 @@
+#ifndef __POWERUTILS_H__
+#define __POWERUTILS_H__
+
+//
+// libpowerutils - direct access to the power controller and INA219 for
+// applications that would otherwise run the power/ina219 tools.
+//
+// Each board is a pu_dev_t opened on a bus:address.  Boards on the same
+// bus share one /dev/i2c-N descriptor whose transfers are serialised, and
+// multi-step sequences (a command and its data) hold a per-address lock,
+// shared with other processes through a lock file, so handles may be used
+// from several threads and programs at once.  Calls return PU_OK or one
+// of the negative PU_ERR_ codes below and never print.
+//
+
+#include "regs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PU_OK                   0
+#define PU_ERR_OPEN             -1      // bus device could not be opened
+#define PU_ERR_ADDRESS          -2      // I2C_SLAVE refused the address
+#define PU_ERR_IO               -3      // transfer failed, see errnum
+#define PU_ERR_NODEV            -4      // no power controller at the address
+#define PU_ERR_TIMEOUT          -5      // controller didn't finish the command
+#define PU_ERR_COMMAND          -6      // controller rejected the command, see command_status
+#define PU_ERR_UNSTABLE         -7      // 32-bit value kept changing while read
+#define PU_ERR_ARG              -8
+#define PU_ERR_NOMEM            -9
+
+#define PU_COMMAND_TIMEOUT_MS   1000
+#define PU_LOCK_DIR             "/run/lock"     // PU_LOCK_DIR overrides, empty for no file locks
+#define PU_STM_MAP_SIZE         NUM_REGISTERS
+
+typedef struct pu_bus pu_bus_t;
+
+// Where bus traffic goes.  The calls mirror the i2c-dev syscalls (the
+// ioctl requests used are I2C_FUNCS, I2C_SLAVE, I2C_RDWR and I2C_SMBUS)
+// and return -1 with errno set on failure.
+typedef struct
+{
+    const char *name;
+    int         ( *open )( int bus );
+    int         ( *close )( int fd );
+    int         ( *ioctl )( int fd, unsigned long request, void *arg );
+    int         ( *read )( int fd, void *buf, int len );
+    int         ( *write )( int fd, const void *buf, int len );
+} pu_transport_t;
+
+extern const pu_transport_t pu_i2cdev_transport;   // /dev/i2c-N, the default
+extern const pu_transport_t pu_sim_transport;      // simulated Power HAT, see powersim.c
+extern const pu_transport_t pu_replay_transport;   // recorded session, see powerreplay.c
+
+typedef struct
+{
+    pu_bus_t       *bus;
+    int             address;
+    int             command_timeout_ms;
+    int             command_status;     // REG_COMMAND as the last command left it
+    unsigned int    command_us;         // how long the last command took
+    unsigned int    transfers;          // I2C transactions issued
+    unsigned int    tears;              // torn 32-bit reads detected and re-read
+    int             errnum;             // errno behind the last OPEN/ADDRESS/IO error
+    unsigned int    locks;              // sequences run under pu_lock()
+    unsigned int    lock_contended;     // ...that had to wait for another thread or process
+    unsigned int    lock_wait_us;       // time spent waiting for those
+    unsigned int    lock_unshared;      // ...run unprotected from other processes, lock file unusable
+} pu_dev_t;
+
+const char *pu_strerror( int err );
+
+// Use separate write/read transfers instead of I2C_RDWR on buses opened
+// from now on
+void pu_set_legacy( int legacy );
+
+// Transport for buses opened from now on.  Unless set, PU_TRANSPORT=sim
+// or replay in the environment selects the simulator or a replay.
+void pu_set_transport( const pu_transport_t *t );
+const pu_transport_t *pu_get_transport( void );
+
+// Record every call made through inner to path, returns the transport to
+// use instead or NULL with errno set.  PU_RECORD=<file> does the same for
+// the transport otherwise chosen.
+const pu_transport_t *pu_record( const pu_transport_t *inner, const char *path );
+
+// Session for pu_replay_transport to serve, fast to skip the recorded
+// call durations.  Otherwise loaded from PU_REPLAY on first open.
+int pu_replay_load( const char *path, int fast );
+
+// Tracing.  Each message on the bus, command and pu_sleep_us() is recorded
+// into a preallocated ring that is written to path whenever it fills and
+// on pu_trace_stop() or exit.  PU_TRACE=<file> in the environment starts a
+// trace when the first bus is opened.  Stop only while no other thread is
+// using the library.  Summarise a trace with putrace.
+#define PU_TRACE_MAGIC          "PUTR"
+#define PU_TRACE_VERSION        1
+#define PU_TRACE_ENTRIES        4096
+
+#define PU_TRACE_WRITE          1       // reg is the pointer written, data follows it
+#define PU_TRACE_READ           2       // reg is the pointer the read started at
+#define PU_TRACE_COMMAND        3       // reg is the command, whole command sequence
+#define PU_TRACE_SLEEP          4
+#define PU_TRACE_TYPE           0x7F
+#define PU_TRACE_CONTINUED      0x80    // later message of a combined transaction
+
+typedef struct
+{
+    char                magic[ 4 ];
+    unsigned short      version;
+    unsigned short      record_size;
+    unsigned long long  monotonic_ns;   // clock the records are timed on
+    unsigned long long  realtime_ns;    // wall clock at the same moment
+} pu_trace_header_t;
+
+typedef struct
+{
+    unsigned long long  start_ns;       // CLOCK_MONOTONIC
+    unsigned int        duration_ns;
+    unsigned int        data;           // first four data bytes, first in the low byte
+    unsigned short      len;            // data bytes
+    unsigned char       type;
+    unsigned char       bus;            // 0xFF when not on a bus (sleeps)
+    unsigned char       address;
+    unsigned char       reg;
+    unsigned char       status;         // REG_COMMAND a command finished with
+    unsigned char       errnum;
+} pu_trace_rec_t;
+
+int  pu_trace_start( const char *path, int entries );
+void pu_trace_stop( void );
+
+// usleep(), recorded in the trace so time spent waiting shows up there
+void pu_sleep_us( unsigned int us );
+
+// CLOCK_MONOTONIC in microseconds, wrapping every 71 minutes; take
+// differences as unsigned
+unsigned int pu_monotonic_us( void );
+
+int  pu_open( pu_dev_t *dev, int bus, int address );
+void pu_close( pu_dev_t *dev );
+
+// Keep other threads and processes off this address for a multi-step
+// sequence.  Nests, hold it no longer than the sequence.
+void pu_lock( pu_dev_t *dev );
+void pu_unlock( pu_dev_t *dev );
+
+// 8-bit registers (power controller and bootloader)
+int pu_reg8_read( pu_dev_t *dev, unsigned char reg, unsigned char *data );
+int pu_reg8_read_multi( pu_dev_t *dev, const unsigned char *regs, unsigned char *data, int count );
+int pu_reg8_block_read( pu_dev_t *dev, unsigned char reg, unsigned char *data, int len );
+int pu_reg8_write( pu_dev_t *dev, unsigned char reg, unsigned char data );
+int pu_reg8_block_write( pu_dev_t *dev, unsigned char reg, const unsigned char *data, int len );
+
+// 16-bit big-endian registers (INA219)
+int pu_reg16_read( pu_dev_t *dev, unsigned char reg, unsigned short *data );
+int pu_reg16_read_multi( pu_dev_t *dev, const unsigned char *regs, unsigned short *data, int count );
+int pu_reg16_write( pu_dev_t *dev, unsigned char reg, unsigned short data );
+
+// Power controller
+int pu_stm_verify( pu_dev_t *dev );
+int pu_stm_snapshot( pu_dev_t *dev, unsigned char *map );
+int pu_stm_data32_read( pu_dev_t *dev, unsigned int *data );
+int pu_stm_data32_write( pu_dev_t *dev, unsigned int data );
+int pu_stm_command( pu_dev_t *dev, unsigned char command );
+int pu_stm_read8( pu_dev_t *dev, unsigned char command, unsigned char *data );
+int pu_stm_read32( pu_dev_t *dev, unsigned char command, unsigned int *data );
+int pu_stm_write32( pu_dev_t *dev, unsigned char command, unsigned int data );
+int pu_stm_read_rtc( pu_dev_t *dev, unsigned int *seconds );
+
+// INA219 bus voltage, current and power as the sensor last converted them,
+// current_lsb in mA as programmed into its calibration register
+int pu_ina219_read( pu_dev_t *dev, double current_lsb, float *mv, float *ma, float *mw );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,319 @@
+//
+// Summarise a libpowerutils trace (PU_TRACE=<file>): where the time went
+// between bus transfers, commands and sleeps, with counts per register and
+// per command.
+//
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "powerutils.h"
+
+typedef struct
+{
+    int                 bus;
+    int                 address;
+    int                 reg;
+    unsigned long       reads;
+    unsigned long       writes;
+    unsigned long       bytes;
+    unsigned long       errors;
+    unsigned long long  ns;
+} reg_stats_t;
+
+typedef struct
+{
+    int                 bus;
+    int                 address;
+    int                 command;
+    unsigned long       count;
+    unsigned long       failed;
+    unsigned long long  ns;
+    unsigned int        max_ns;
+} command_stats_t;
+
+char *trace_name = NULL;
+int dump = 0;
+
+reg_stats_t *regs = NULL;
+int reg_count = 0;
+command_stats_t *commands = NULL;
+int command_count = 0;
+
+
+void show_usage( char *progname )
+{
+    fprintf( stderr, "Usage: %s [OPTION] <trace file>\n", progname );
+    fprintf( stderr, "   Options:\n" );
+    fprintf( stderr, "      -h --help               Show usage\n" );
+    fprintf( stderr, "      -d --dump               List every record before the summary\n" );
+    exit( 1 );
+}
+
+
+void parse( int argc, char *argv[] )
+{
+    while( 1 )
+    {
+        static const struct option lopts[] =
+        {
+            { "dump",       0, 0, 'd' },
+            { "help",       0, 0, 'h' },
+            { NULL,         0, 0, 0 },
+        };
+        int c;
+
+        c = getopt_long( argc, argv, "dh", lopts, NULL );
+
+        if( c == -1 )
+            break;
+
+        switch( c )
+        {
+            case 'd':
+            {
+                dump = 1;
+                break;
+            }
+
+            default:
+            case 'h':
+            {
+                show_usage( argv[ 0 ] );
+                break;
+            }
+        }
+    }
+
+    if ( optind != argc - 1 )
+    {
+        show_usage( argv[ 0 ] );
+    }
+    trace_name = argv[ optind ];
+}
+
+
+reg_stats_t *reg_find( const pu_trace_rec_t *r )
+{
+    int i;
+
+    for ( i = 0; i < reg_count; i++ )
+    {
+        if ( ( regs[ i ].bus == r->bus ) && ( regs[ i ].address == r->address ) && ( regs[ i ].reg == r->reg ) )
+            return &regs[ i ];
+    }
+
+    regs = realloc( regs, ( reg_count + 1 ) * sizeof( *regs ) );
+    if ( regs == NULL )
+    {
+        fprintf( stderr, "Out of memory\n" );
+        exit( 1 );
+    }
+    memset( &regs[ reg_count ], 0, sizeof( *regs ) );
+    regs[ reg_count ].bus = r->bus;
+    regs[ reg_count ].address = r->address;
+    regs[ reg_count ].reg = r->reg;
+    return &regs[ reg_count++ ];
+}
+
+
+command_stats_t *command_find( const pu_trace_rec_t *r )
+{
+    int i;
+
+    for ( i = 0; i < command_count; i++ )
+    {
+        if ( ( commands[ i ].bus == r->bus ) && ( commands[ i ].address == r->address ) && ( commands[ i ].command == r->reg ) )
+            return &commands[ i ];
+    }
+
+    commands = realloc( commands, ( command_count + 1 ) * sizeof( *commands ) );
+    if ( commands == NULL )
+    {
+        fprintf( stderr, "Out of memory\n" );
+        exit( 1 );
+    }
+    memset( &commands[ command_count ], 0, sizeof( *commands ) );
+    commands[ command_count ].bus = r->bus;
+    commands[ command_count ].address = r->address;
+    commands[ command_count ].command = r->reg;
+    return &commands[ command_count++ ];
+}
+
+
+void dump_record( const pu_trace_rec_t *r, unsigned long long base )
+{
+    static const char *types[] = { "?", "write", "read", "command", "sleep" };
+    int type = r->type & PU_TRACE_TYPE;
+
+    printf( "%12.6f %8.3f ms  %-7s", ( r->start_ns - base ) / 1e9, r->duration_ns / 1e6, types[ ( type <= PU_TRACE_SLEEP ) ? type : 0 ] );
+    if ( type != PU_TRACE_SLEEP )
+    {
+        printf( " %d:%02X %02X", r->bus, r->address, r->reg );
+    }
+    if ( ( type == PU_TRACE_READ ) || ( type == PU_TRACE_WRITE ) )
+    {
+        printf( "%s len %d", ( r->type & PU_TRACE_CONTINUED ) ? "+" : " ", r->len );
+        if ( r->len > 0 ) printf( " data %0*X", ( r->len < 4 ? r->len : 4 ) * 2, r->data );
+    }
+    if ( type == PU_TRACE_COMMAND )
+    {
+        printf( "  status %02X", r->status );
+    }
+    if ( r->errnum )
+    {
+        printf( "  %s", strerror( r->errnum ) );
+    }
+    printf( "\n" );
+}
+
+
+int compare_regs( const void *a, const void *b )
+{
+    const reg_stats_t *x = a, *y = b;
+
+    if ( x->bus != y->bus ) return x->bus - y->bus;
+    if ( x->address != y->address ) return x->address - y->address;
+    return x->reg - y->reg;
+}
+
+
+int compare_commands( const void *a, const void *b )
+{
+    const command_stats_t *x = a, *y = b;
+
+    if ( x->bus != y->bus ) return x->bus - y->bus;
+    if ( x->address != y->address ) return x->address - y->address;
+    return x->command - y->command;
+}
+
+
+int main( int argc, char *argv[] )
+{
+    pu_trace_header_t hdr;
+    pu_trace_rec_t r;
+    unsigned long records = 0, transactions = 0, failed = 0, sleeps = 0, ncommands = 0, command_failed = 0;
+    unsigned long long bus_ns = 0, sleep_ns = 0, command_ns = 0, first = 0, last = 0;
+    time_t started;
+    FILE *fp;
+    int i;
+
+    parse( argc, argv );
+
+    fp = fopen( trace_name, "rb" );
+    if ( fp == NULL )
+    {
+        fprintf( stderr, "Error opening %s: %s\n", trace_name, strerror( errno ) );
+        return 1;
+    }
+
+    if ( ( fread( &hdr, sizeof( hdr ), 1, fp ) != 1 ) ||
+         ( memcmp( hdr.magic, PU_TRACE_MAGIC, 4 ) != 0 ) ||
+         ( hdr.version != PU_TRACE_VERSION ) ||
+         ( hdr.record_size != sizeof( r ) ) )
+    {
+        fprintf( stderr, "%s is not a supported trace file\n", trace_name );
+        fclose( fp );
+        return 1;
+    }
+
+    while ( fread( &r, sizeof( r ), 1, fp ) == 1 )
+    {
+        int type = r.type & PU_TRACE_TYPE;
+
+        if ( dump )
+        {
+            dump_record( &r, hdr.monotonic_ns );
+        }
+
+        if ( records++ == 0 ) first = r.start_ns;
+        if ( r.start_ns + r.duration_ns > last ) last = r.start_ns + r.duration_ns;
+
+        switch ( type )
+        {
+            case PU_TRACE_WRITE:
+            case PU_TRACE_READ:
+            {
+                reg_stats_t *s = reg_find( &r );
+
+                if ( !( r.type & PU_TRACE_CONTINUED ) )
+                {
+                    transactions++;
+                    if ( r.errnum ) failed++;
+                }
+                bus_ns += r.duration_ns;
+
+                // A write of the pointer alone is the first half of a read
+                if ( type == PU_TRACE_READ ) s->reads++;
+                else if ( r.len > 0 ) s->writes++;
+                s->bytes += r.len;
+                s->ns += r.duration_ns;
+                if ( r.errnum ) s->errors++;
+                break;
+            }
+
+            case PU_TRACE_COMMAND:
+            {
+                command_stats_t *s = command_find( &r );
+
+                ncommands++;
+                command_ns += r.duration_ns;
+                s->count++;
+                s->ns += r.duration_ns;
+                if ( r.duration_ns > s->max_ns ) s->max_ns = r.duration_ns;
+                if ( r.status != 0 )
+                {
+                    s->failed++;
+                    command_failed++;
+                }
+                break;
+            }
+
+            case PU_TRACE_SLEEP:
+            {
+                sleeps++;
+                sleep_ns += r.duration_ns;
+                break;
+            }
+        }
+    }
+    fclose( fp );
+
+    if ( dump && records )
+    {
+        printf( "\n" );
+    }
+
+    started = hdr.realtime_ns / 1000000000ULL;
+    printf( "%lu records over %.3f ms, trace started %s\n", records, records ? ( last - first ) / 1e6 : 0.0, ctime( &started ) );
+    printf( "Bus time     %10.3f ms in %lu transactions (%lu failed)\n", bus_ns / 1e6, transactions, failed );
+    printf( "Commands     %10.3f ms in %lu commands (%lu failed)\n", command_ns / 1e6, ncommands, command_failed );
+    printf( "Sleep time   %10.3f ms in %lu sleeps\n", sleep_ns / 1e6, sleeps );
+
+    if ( reg_count > 0 )
+    {
+        qsort( regs, reg_count, sizeof( *regs ), compare_regs );
+        printf( "\nRegister       reads   writes    bytes     bus ms   errors\n" );
+        for ( i = 0; i < reg_count; i++ )
+        {
+            printf( "  %2d:%02X %02X  %8lu %8lu %8lu %10.3f %8lu\n", regs[ i ].bus, regs[ i ].address, regs[ i ].reg,
+                    regs[ i ].reads, regs[ i ].writes, regs[ i ].bytes, regs[ i ].ns / 1e6, regs[ i ].errors );
+        }
+    }
+
+    if ( command_count > 0 )
+    {
+        qsort( commands, command_count, sizeof( *commands ), compare_commands );
+        printf( "\nCommand        count  mean ms   max ms   failed\n" );
+        for ( i = 0; i < command_count; i++ )
+        {
+            printf( "  %2d:%02X %02X  %8lu %8.3f %8.3f %8lu\n", commands[ i ].bus, commands[ i ].address, commands[ i ].command,
+                    commands[ i ].count, commands[ i ].ns / 1e6 / commands[ i ].count, commands[ i ].max_ns / 1e6, commands[ i ].failed );
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+#!/bin/bash
+#
+# Run each tool path against the simulated board under a set of fault
+# scenarios (see the PU_SIM_ variables in powersim.c) and report how often
+# it completes, how long it takes and how it fails.
+#
+#   ./scenarios.sh [file]
+#
+# Scenarios are read from file, one per line as "name VAR=value ...", or
+# the built-in set below is used.  SCENARIO_RUNS sets the runs per path
+# (default 10, uploads run once) and POWER_ARGS is added to every power
+# command, e.g. POWER_ARGS="-W 300" to try a shorter command timeout.
+#
+
+. "$(dirname "$0")/simtest.sh"
+
+RUNS=${SCENARIO_RUNS:-10}
+UPLOAD_RUNS=${SCENARIO_UPLOAD_RUNS:-1}
+STATS=$(mktemp)
+ERRORS=$(mktemp)
+IMAGE=$(mktemp)
+STATE=$(mktemp -d)
+
+export PU_TRANSPORT=sim
+export PU_SIM_STATS=$STATS
+export PU_STATE_DIR=$STATE      # keep manifests and checkpoints off the real ones
+
+trap 'rm -f $STATS $ERRORS $IMAGE; rm -rf $STATE' EXIT
+
+SCENARIOS="
+clean
+slow-bus        PU_SIM_KHZ=10
+stretching      PU_SIM_LATENCY=exp:300
+nak-1%          PU_SIM_NAK=1
+nak-10%         PU_SIM_NAK=10
+slow-commands   PU_SIM_COMMAND_US=200-50000
+command-tail    PU_SIM_COMMAND_US=exp:250000
+stuck-command   PU_SIM_STUCK=10
+command-error   PU_SIM_STUCK=10:0xEE
+slow-flash      PU_SIM_FLASH_US=3000-30000
+flash-errors    PU_SIM_FLASH_FAIL=1
+slow-reboot     PU_SIM_BOOT_MS=2500
+"
+
+# path <name> <runs> <command...>, run with the scenario's variables exported
+path()
+{
+    local name=$1 runs=$2 ok=0 start end i ms
+    local total=0 max=0
+
+    shift 2
+    (( runs > 0 )) || return
+    : > $STATS
+    : > $ERRORS
+    for (( i = 0; i < runs; i++ )); do
+        start=$(now)
+        if "$@" > /dev/null 2> $ERRORS.run; then
+            ok=$(( ok + 1 ))
+        else
+            head -1 $ERRORS.run >> $ERRORS
+        fi
+        end=$(now)
+        ms=$(( ( end - start ) / 1000000 ))
+        total=$(( total + ms ))
+        (( ms > max )) && max=$ms
+    done
+    rm -f $ERRORS.run
+
+    printf "  %-18s %3d/%-3d %9d %9d %7.1f   %s\n" "$name" $ok $runs $(( total / runs )) $max \
+        $(awk -v runs=$runs '{ f += $6 } END { print f / runs }' $STATS) \
+        "$(sort $ERRORS | uniq -c | sort -rn | head -1 | sed 's/^ *[0-9]* //')"
+}
+
+mkimage $IMAGE
+
+if [ -n "$1" ]; then
+    SCENARIOS=$(cat "$1") || exit 1
+fi
+
+while read -r name vars; do
+    [ -z "$name" ] || [ "${name:0:1}" = "#" ] && continue
+
+    echo "$name ${vars:+($vars)}"
+    printf "  %-18s %7s %9s %9s %7s   %s\n" "path" "ok" "mean ms" "max ms" "faults" "most common failure"
+    (
+        for v in $vars; do
+            export "$v"
+        done
+        path "power -q" $RUNS ./power $POWER_ARGS -q
+        path "power -v rate" $RUNS ./power $POWER_ARGS -v rate
+        path "power -r" $RUNS ./power $POWER_ARGS -r
+        path "power -Z" $UPLOAD_RUNS ./power $POWER_ARGS -F -Z $IMAGE
+        path "ina219" $RUNS ./ina219
+    )
+    echo
+done <<< "$SCENARIOS"
@@ -0,0 +1,21 @@
+#
+# Helpers shared by bench.sh and scenarios.sh, sourced by both.
+#
+
+now()
+{
+    date +%s%N
+}
+
+# mkimage <file>, a 6000 byte firmware image of random pages with an all
+# zero and an all 0xFF page between them, which the upload must program
+# like any other
+mkimage()
+{
+    {
+        head -c 1280 /dev/urandom
+        head -c 128 /dev/zero
+        head -c 128 /dev/zero | tr '\0' '\377'
+        head -c 4464 /dev/urandom
+    } > "$1"
+}